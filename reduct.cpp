@@ -1,299 +1,9752 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
 #include <sstream>
 #include <stack>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <variant>
+#include <vector>
 
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#if __has_include(<linux/io_uring.h>)
+#define REDUCT_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
-class table;
-using table_ptr = std::shared_ptr<table>;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
+// Counters of what each thread does, for the stats binding and the REPL's
+// :alloc and :stats. Building with REDUCT_NO_INSTRUMENTATION removes them and
+// every increment.
+#ifndef REDUCT_NO_INSTRUMENTATION
+#define REDUCT_INSTRUMENTATION
+#endif
 
-class table
+
+#ifdef REDUCT_INSTRUMENTATION
+enum class op_counter
 {
-public:
-	using values_map = std::map<table, table>;
-	using values_type = std::variant<std::string, values_map>;
+	allocations,
+	allocated_bytes,
+	nodes,
+	copies,
+	with_copies,
+	copied_entries,
+	lookup_hits,
+	lookup_misses,
+	equal_comparisons,
+	less_comparisons,
+	read_bytes,
+	read_tokens,
+	printed_bytes,
+	count,
+};
 
-	table() : m_values(values_map()) {}
-	table(char const* value) : m_values(value) {}
-	table(std::string const& value) : m_values(value) {}
-	table(std::initializer_list<values_map::value_type> list) : m_values(list) {}
-	
-	bool operator== (table const& rhs) const
+constexpr std::size_t op_counter_count = static_cast<std::size_t>(op_counter::count);
+
+constexpr char const* op_counter_names[op_counter_count] = {
+	"allocations", "allocated-bytes", "nodes", "copies", "with-copies", "copied-entries",
+	"lookup-hits", "lookup-misses", "equal-comparisons", "less-comparisons",
+	"read-bytes", "read-tokens", "printed-bytes" };
+
+using op_counters = std::array<std::uint64_t, op_counter_count>;
+
+
+// The counters of one thread, on cache lines of their own. Only the thread
+// itself writes them, with a relaxed load and store instead of an atomic
+// increment, so counting costs what a plain increment does; other threads only
+// read them, to add them up. Blocks are linked into a list while their thread
+// runs, and a thread that ends leaves its counts in the retired totals.
+struct alignas(64) counter_block
+{
+	counter_block();
+	~counter_block();
+
+	counter_block(counter_block const&) = delete;
+	counter_block& operator= (counter_block const&) = delete;
+
+	void add(op_counter counter, std::uint64_t n)
 	{
-		return m_values == rhs.m_values;
+		auto& value = values[static_cast<std::size_t>(counter)];
+		value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
 	}
 
-	bool operator!= (table const& rhs) const
+	op_counters snapshot() const
 	{
-		return !operator==(rhs);
+		op_counters counts;
+		for (std::size_t i = 0; i < op_counter_count; ++i)
+		{
+			counts[i] = values[i].load(std::memory_order_relaxed);
+		}
+		return counts;
 	}
 
-	bool operator< (table const& rhs) const
+	std::array<std::atomic<std::uint64_t>, op_counter_count> values{};
+	counter_block* prev = nullptr;
+	counter_block* next = nullptr;
+};
+
+
+// Constant initialized, so threads can register before any constructor runs.
+struct counter_registry
+{
+	std::mutex mutex;
+	counter_block* blocks = nullptr;
+	op_counters retired{};
+} counters_of_threads;
+
+
+// The block itself needs constructing and destroying, and every access to such
+// a thread_local checks whether it has been; the pointer to it does not.
+thread_local counter_block* t_counters = nullptr;
+thread_local bool t_counters_exited = false;
+
+
+counter_block::counter_block()
+{
+	std::lock_guard<std::mutex> lock(counters_of_threads.mutex);
+	next = counters_of_threads.blocks;
+	if (next)
 	{
-		return m_values < rhs.m_values;
+		next->prev = this;
 	}
+	counters_of_threads.blocks = this;
+}
+
 
-	table operator[](table const& key) const
+counter_block::~counter_block()
+{
 	{
-		if (auto pstr = std::get_if<std::string>(&m_values))
+		std::lock_guard<std::mutex> lock(counters_of_threads.mutex);
+		auto const counts = snapshot();
+		for (std::size_t i = 0; i < op_counter_count; ++i)
 		{
-			return "type-error";
+			counters_of_threads.retired[i] += counts[i];
 		}
-
-		auto const& values = std::get<values_map>(m_values);
-		auto const it = values.find(key);
-		if (it == cend(values))
+		(prev ? prev->next : counters_of_threads.blocks) = next;
+		if (next)
 		{
-			return "lookup-error";
+			next->prev = prev;
 		}
-		return it->second;
 	}
-
-	table with(table key, table value) const
+	if (t_counters == this)
 	{
-		assert(!std::holds_alternative<std::string>(m_values));
-		values_type new_values = m_values;
-		std::get<values_map>(new_values).insert_or_assign( key, value );
-		return new_values;
+		t_counters = nullptr;
+		t_counters_exited = true;
 	}
+}
 
-	bool empty() const
-	{
-		if (auto pvals = std::get_if<values_map>(&m_values))
-		{
-			return pvals->empty();
-		}
-		return false;
-	}
 
-	std::optional<std::string> as_string() const
+// Counts made in destructors that run at thread exit after the thread's own
+// block is gone. Never destroyed, so it outlives all of them; as threads share
+// it, a count there can be lost to another.
+counter_block& late_counters()
+{
+	alignas(counter_block) static unsigned char storage[sizeof(counter_block)];
+	static counter_block* const counters = new (storage) counter_block;
+	return *counters;
+}
+
+
+counter_block& register_thread_counters()
+{
+	if (t_counters_exited)
 	{
-		if (auto pstr = std::get_if<std::string>(&m_values))
-		{
-			return (*pstr);
-		}
-		return std::nullopt;
+		return late_counters();
 	}
+	thread_local counter_block counters;
+	t_counters = &counters;
+	return counters;
+}
 
-	std::optional<values_map> as_values() const
+inline counter_block& thread_counters()
+{
+	return t_counters ? *t_counters : register_thread_counters();
+}
+
+
+// The counts of all threads so far, those that ended included.
+op_counters all_counters()
+{
+	std::lock_guard<std::mutex> lock(counters_of_threads.mutex);
+	auto total = counters_of_threads.retired;
+	for (auto block = counters_of_threads.blocks; block; block = block->next)
 	{
-		if (auto pvals = std::get_if<values_map>(&m_values))
+		auto const counts = block->snapshot();
+		for (std::size_t i = 0; i < op_counter_count; ++i)
 		{
-			return (*pvals);
+			total[i] += counts[i];
 		}
-		return std::nullopt;
 	}
+	return total;
+}
 
-private:
-	table(values_type values) : m_values(values) {}
-
-private:
-	values_type m_values;
-};
-
+#define REDUCT_COUNT(counter, n) (thread_counters().add(op_counter::counter, (n)))
 
-table const lookup_error{ "lookup-error" };
-table const read_error{ "read-error" };
+void* operator new(std::size_t size)
+{
+	REDUCT_COUNT(allocations, 1);
+	REDUCT_COUNT(allocated_bytes, size);
+	if (void* const p = std::malloc(size ? size : 1))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
 
+// Not inlined: GCC would otherwise see free() applied to what operator new
+// returned and warn about a mismatch. MSVC takes its own spelling and warns
+// about attributes it does not know.
+#ifdef _MSC_VER
+#define REDUCT_NOINLINE __declspec(noinline)
+#else
+#define REDUCT_NOINLINE [[gnu::noinline]]
+#endif
 
-bool issymbol(char c)
+REDUCT_NOINLINE void operator delete(void* p) noexcept
 {
-	return isalnum(c);
+	std::free(p);
 }
 
-
-auto make_error(table const& type, table const& message) -> table
+REDUCT_NOINLINE void operator delete(void* p, std::size_t) noexcept
 {
-	return table({
-		{"type", "error"},
-		{"error-type", type},
-		{"message", message}
-	});
+	std::free(p);
 }
 
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept
+{
+	REDUCT_COUNT(allocations, 1);
+	REDUCT_COUNT(allocated_bytes, size);
+	return std::malloc(size ? size : 1);
+}
 
-auto make_lookup_expr(table const& map, table const& key) -> table
+REDUCT_NOINLINE void operator delete(void* p, std::nothrow_t const&) noexcept
 {
-	return table({
-		{"type", "lookup-expression"},
-		{"map", map},
-		{"key", key}
-	});
+	std::free(p);
 }
+#else
+#define REDUCT_COUNT(counter, n) ((void)0)
+#endif
 
 
-auto read(std::string const& input) -> table
+// Spans of wall time on each thread — reading, evaluating, printing and the
+// bigger table operations — exported as Chrome trace-event JSON, which
+// chrome://tracing and Perfetto show as one timeline per thread. Building with
+// REDUCT_NO_TRACING removes them; otherwise nothing is recorded until
+// tracing::enabled is set, and a span costs one relaxed load until then.
+#ifndef REDUCT_NO_TRACING
+#define REDUCT_TRACING
+#endif
+
+
+#ifdef REDUCT_TRACING
+namespace tracing
 {
-	table expr;
-	std::stack<table> expr_stack;
+	std::atomic<bool> enabled{ false };
+
+	inline std::uint64_t now()
+	{
+		static auto const start = std::chrono::steady_clock::now();
+		return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	}
 
-	auto it = cbegin(input);
-	auto const last = cend(input);
-	while (it != cend(input))
+	// The spans a thread has finished, the latest capacity of them. Only the
+	// thread writes; an export may read at the same time, so the fields are
+	// atomics written and read relaxed, and the export drops entries that the
+	// writer came round to again while they were being copied.
+	struct ring
 	{
-		char const c = (*it);
-		if (isspace(c))
+		static constexpr std::size_t capacity = 1 << 16;
+
+		struct span
 		{
-			++it;
-		}
-		else if (issymbol(c))
+			std::atomic<char const*> name;
+			std::atomic<std::uint64_t> start;
+			std::atomic<std::uint64_t> duration;
+		};
+
+		void add(char const* name, std::uint64_t start, std::uint64_t duration)
 		{
-			auto const first = it;
-			while (it != last && issymbol(*it))
-			{
-				++it;
-			}
+			auto const index = head.load(std::memory_order_relaxed);
+			auto& entry = spans[index % capacity];
+			entry.name.store(name, std::memory_order_relaxed);
+			entry.start.store(start, std::memory_order_relaxed);
+			entry.duration.store(duration, std::memory_order_relaxed);
+			head.store(index + 1, std::memory_order_release);
+		}
+
+		std::unique_ptr<span[]> spans{ new span[capacity]() };
+		std::atomic<std::uint64_t> head{ 0 };
+		unsigned thread = 0;
+	};
 
-			std::string sym{ first, it };
-			expr = (expr.empty()) ? sym : make_lookup_expr(expr, sym);
+	// Rings outlive their threads, so an export still shows workers that ended.
+	std::mutex rings_mutex;
+	std::vector<std::unique_ptr<ring>> rings;
+	thread_local ring* t_ring = nullptr;
+
+	inline ring& thread_ring()
+	{
+		if (!t_ring)
+		{
+			auto fresh = std::make_unique<ring>();
+			std::lock_guard<std::mutex> lock(rings_mutex);
+			fresh->thread = static_cast<unsigned>(rings.size() + 1);
+			t_ring = fresh.get();
+			rings.push_back(std::move(fresh));
 		}
-		else if (c == '(')
+		return *t_ring;
+	}
+
+	class scope
+	{
+	public:
+		explicit scope(char const* name)
+			: m_name(enabled.load(std::memory_order_relaxed) ? name : nullptr)
+			, m_start(m_name ? now() : 0)
 		{
-			++it;
-			expr_stack.push(expr);
-			expr = table();
 		}
-		else if (c == ')' && !expr_stack.empty())
+
+		scope(scope const&) = delete;
+		scope& operator= (scope const&) = delete;
+
+		~scope()
 		{
-			++it;
-			table parent = expr_stack.top();
-			expr_stack.pop();
-			if (expr.empty())
+			if (m_name)
 			{
-				// () is essentially whitespace, it is not an evaluated lookup. 
-				//TODO: Should this be an error?
-				expr = parent;
-			}
-			else if (!parent.empty())
-			{
-				// Only make a lookup expression if the parent should be considered a 
-				// map, otherwise read("(1)") becomes the lookup '({} 1)'.
-				expr = make_lookup_expr(parent, expr);
+				thread_ring().add(m_name, m_start, now() - m_start);
 			}
 		}
-		else if (c == '"')
+
+	private:
+		char const* const m_name;
+		std::uint64_t const m_start;
+	};
+
+	// Writes the spans recorded so far as a JSON object of trace events.
+	void write(std::ostream& out)
+	{
+		struct recorded
+		{
+			char const* name;
+			std::uint64_t start;
+			std::uint64_t duration;
+		};
+
+		out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+		char const* sep = "";
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		std::vector<recorded> copied;
+		for (auto const& r : rings)
 		{
-			++it; // opening quote
-			if (it == last)
+			auto const head = r->head.load(std::memory_order_acquire);
+			auto const first = head > ring::capacity ? head - ring::capacity : 0;
+			copied.clear();
+			for (auto i = first; i < head; ++i)
 			{
-				return make_error(read_error, "Missing closing '\"'");
+				auto const& entry = r->spans[i % ring::capacity];
+				copied.push_back({ entry.name.load(std::memory_order_relaxed), entry.start.load(std::memory_order_relaxed), entry.duration.load(std::memory_order_relaxed) });
 			}
+			auto const after = r->head.load(std::memory_order_acquire);
+			auto const valid = after > ring::capacity ? after - ring::capacity : 0;
 
-			std::ostringstream buf;
-			while ((*it) != '"')
+			out << sep << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << r->thread
+				<< ",\"args\":{\"name\":\"thread " << r->thread << "\"}}";
+			sep = ",";
+			for (auto i = std::max(first, valid); i < head; ++i)
 			{
-				if (*it == '\\')
-				{
-					++it;
-				}
-				buf << (*it);
-				++it;
-
-				if (it == last)
-				{
-					return make_error(read_error, "Missing closing '\"'");
-				}
+				auto const& span = copied[i - first];
+				out << ",{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << r->thread
+					<< ",\"ts\":" << span.start / 1000 << '.' << std::setw(3) << std::setfill('0') << span.start % 1000
+					<< ",\"dur\":" << span.duration / 1000 << '.' << std::setw(3) << std::setfill('0') << span.duration % 1000 << "}";
 			}
-			++it; // closing quote
-
-			auto const str = buf.str();
-			expr = (expr.empty()) ? str : make_lookup_expr(expr, str);
-		}
-		else
-		{
-			return make_error(read_error, std::string("Unexpected '") + c + "'");
 		}
+		out << "]}\n";
 	}
 
-	if (!expr_stack.empty())
+	bool save(std::string const& path)
 	{
-		return make_error(read_error, "Missing ')'");
+		std::ofstream out(path, std::ios::trunc);
+		write(out);
+		return static_cast<bool>(out);
 	}
-	return expr;
 }
 
+#define REDUCT_TRACE_JOIN(a, b) a##b
+#define REDUCT_TRACE_NAME(line) REDUCT_TRACE_JOIN(trace_scope_, line)
+#define REDUCT_TRACE(name) tracing::scope const REDUCT_TRACE_NAME(__LINE__)(name)
+#else
+#define REDUCT_TRACE(name) ((void)0)
+#endif
 
-std::string pretty(table const& tab)
+
+class table;
+using table_ptr = std::shared_ptr<table>;
+class table_node;
+class table_source;
+
+
+class table
 {
-	if (auto pstr = tab.as_string())
+public:
+	using values_map = std::map<table, table>;
+	using values_type = std::variant<std::string, values_map>;
+
+	table() = default;
+	table(char const* value);
+	table(std::string const& value);
+	table(std::initializer_list<values_map::value_type> list);
+	table(values_map values);
+	explicit table(std::unique_ptr<table_source const> source);
+
+	table(table const& other);
+	table(table&& other) noexcept;
+	~table();
+	table& operator= (table other) noexcept;
+	
+	bool operator== (table const& rhs) const;
+
+	bool operator!= (table const& rhs) const
 	{
-		if (std::any_of(pstr->begin(), pstr->end(), isspace))
+		return !operator==(rhs);
+	}
+
+	bool operator< (table const& rhs) const
+	{
+		REDUCT_COUNT(less_comparisons, 1);
+		return m_node != rhs.m_node && values() < rhs.values();
+	}
+
+	table operator[](table const& key) const;
+
+	table with(table key, table value) const;
+
+	bool empty() const;
+
+	bool is_string() const;
+
+	std::optional<std::string> as_string() const
+	{
+		if (auto pstr = std::get_if<std::string>(&values()))
 		{
-			return '"' + (*pstr) + '"';
+			return (*pstr);
 		}
-		else
+		return std::nullopt;
+	}
+
+	std::optional<values_map> as_values() const
+	{
+		if (auto pvals = std::get_if<values_map>(&values()))
 		{
-			return (*pstr);
+			return (*pvals);
 		}
+		return std::nullopt;
 	}
 
-	std::ostringstream out;
-	table const type = tab["type"];
-	if (type == "lookup-expression")
+	// Visits the entries of a map in key order without copying it.
+	template <typename F>
+	void for_each(F&& f) const
 	{
-		out << "(" << pretty(tab["map"]);
-		if (tab["key"] != "lookup-error")
+		if (source() && for_each_source(f))
 		{
-			out << " " << pretty(tab["key"]);
+			return;
+		}
+
+		if (auto pvals = std::get_if<values_map>(&values()))
+		{
+			for (auto const& kv : *pvals)
+			{
+				f(kv.first, kv.second);
+			}
 		}
-		out << ")";
 	}
-	else if (type == "error")
+
+	// Structural hash, computed once per node.
+	std::size_t hash() const;
+
+	// The backing of a table that does not live on the heap, or null.
+	table_source const* source() const;
+
+	// Folds in reference counts that other threads have handed back to this one.
+	// Happens on allocation anyway; long-lived threads that stop allocating (idle
+	// server workers) can call this to free tables released elsewhere.
+	static void reconcile();
+
+private:
+	friend class intern_pool;
+	friend class binary_writer;
+	friend class json_writer;
+	friend class column_store;
+	friend class rope;
+	friend auto footprint(table const& root) -> table;
+	friend auto encode_strings(table const& t, std::size_t min_repeats) -> table;
+
+	table(values_type values);
+	explicit table(table_node* node) noexcept : m_node(node) {}
+
+	values_type const& values() const;
+	bool for_each_source(std::function<void(table const&, table const&)> const& f) const;
+
+private:
+	table_node* m_node = nullptr; // nullptr is the empty map
+};
+
+
+// Backing for tables whose contents live somewhere other than the heap, such as a
+// mapped file. Lookups go to the source directly; anything that needs the whole
+// value (comparison, iteration, with()) decodes it once. Decoding only has to
+// produce one level, subtables can be further sources.
+class table_source
+{
+public:
+	virtual ~table_source() = default;
+
+	virtual bool is_string() const = 0;
+	virtual std::size_t size() const = 0;
+	virtual table lookup(table const& key) const = 0;
+	virtual table::values_type decode() const = 0;
+
+	// Sources that can update or iterate in place override these; the defaults
+	// decline, and the table falls back to its decoded value.
+	virtual std::optional<table> with(table const& /*key*/, table const& /*value*/) const
 	{
-		out << *(tab["error-type"].as_string()) << ": " << *(tab["message"].as_string());
+		return std::nullopt;
 	}
-	else
+
+	virtual bool for_each(std::function<void(table const&, table const&)> const& /*f*/) const
 	{
-		out << "{";
-		char const* sep = "";
-		auto const vals = (*tab.as_values());
-		for (auto kv : vals)
+		return false;
+	}
+
+	// Memory behind the source, for footprints: bytes of its own beyond the node,
+	// the tables it keeps, and backing that other sources may share, such as a
+	// document or a mapped file. Backing is counted by the first source to report
+	// it, as told by first().
+	struct memory
+	{
+		std::uint64_t bytes = 0;   // of its own
+		std::vector<table> tables; // kept by it, walked like map entries
+		std::uint64_t backing = 0; // on the heap, shared with other sources
+		std::uint64_t mapped = 0;  // of mapped files, in memory now
+		std::unordered_set<void const*>* seen = nullptr;
+
+		bool first(void const* key)
 		{
-			out << sep << pretty(kv.first) << " = " << pretty(kv.second);
-			sep = ", ";
+			return seen->insert(key).second;
 		}
-		out << "}";
+	};
+
+	virtual void resident(memory& /*usage*/) const
+	{
 	}
-	return out.str();
-}
+};
 
 
-std::ostream& operator<<(std::ostream& out, table const& t)
+// Table storage is an immutable node whose reference count is biased towards the
+// thread that allocated it. The owner counts its own references with a plain
+// integer; any other thread uses the atomic shared count, which may go negative
+// when references made by the owner are dropped elsewhere. In that case the node
+// is queued for its owner, who merges both counts into the shared one and from
+// then on counts atomically as well. Single-threaded code never pays for atomics.
+struct rc_queue
 {
-	out << pretty(t);
-	return out;
-}
+	std::mutex mutex;
+	std::vector<table_node*> nodes;
+	std::atomic<bool> pending = false;
+	bool alive = true;
+	bool draining = false;
 
+	void push(table_node* node);
+	void drain();
 
-int main(int argc, char* argv[])
-{
-	table const empty;
-	assert(empty == empty);
-	assert(empty == table());
-	assert(empty != "test");
-	
-	table const test = "test";
-	assert(test == table("test"));
-	assert(test != table());
+private:
+	static void merge_all(std::vector<table_node*> const& queued);
+};
 
-	std::cout << "empty: '" << empty << "'\n";
-	std::cout << "symbol: '" << test << "'\n";
 
-	while (true)
+thread_local rc_queue* t_rc_queue = nullptr;
+thread_local bool t_rc_exited = false;
+
+
+class table_node
+{
+public:
+	struct shared_tag {};
+
+	table_node(table::values_type values)
+		: m_values(std::move(values))
 	{
-		std::cout << "> ";
-		std::string input;
-		std::getline(std::cin, input);
-		table const value = read(input);
-		std::cout << value << "\n";
+		REDUCT_COUNT(nodes, 1);
+		if (!t_rc_queue && !t_rc_exited)
+		{
+			adopt_queue();
+		}
+
+		m_home = t_rc_queue;
+		if (m_home)
+		{
+			if (m_home->pending.load(std::memory_order_relaxed))
+			{
+				m_home->drain();
+			}
+			m_biased = 1;
+		}
+		else
+		{
+			// Allocated while the thread is shutting down: count atomically only.
+			m_merged = true;
+			m_shared.store(count_one | merged_flag, std::memory_order_relaxed);
+		}
+	}
+
+	// Counted atomically from the start, for nodes that are meant to be shared
+	// between threads (interned values). The shared count is then exact.
+	table_node(table::values_type values, shared_tag)
+		: m_values(std::move(values))
+		, m_merged(true)
+		, m_interned(true)
+		, m_shared(count_one | merged_flag)
+	{
+		REDUCT_COUNT(nodes, 1);
+	}
+
+	table_node(std::unique_ptr<table_source const> source)
+		: table_node(table::values_type())
+	{
+		m_source = std::move(source);
+	}
+
+	table::values_type const& values() const
+	{
+		if (m_source)
+		{
+			std::call_once(m_decoded, [this]()
+			{
+				m_values = m_source->decode();
+				m_has_values.store(true, std::memory_order_release);
+			});
+		}
+		return m_values;
+	}
+
+	// Whether values() is there without decoding.
+	bool decoded() const
+	{
+		return !m_source || m_has_values.load(std::memory_order_acquire);
+	}
+
+	table_source const* source() const
+	{
+		return m_source.get();
+	}
+
+	bool interned() const
+	{
+		return m_interned;
+	}
+
+	// Only meaningful for shared nodes, whose whole count is in the shared word.
+	bool unique() const
+	{
+		return m_shared.load(std::memory_order_acquire) == (count_one | merged_flag);
+	}
+
+	// All references to the node, if this thread can count them. The biased
+	// count is only the owner's to read, so a node another thread owns and has
+	// not merged yet gives nullopt.
+	std::optional<std::intptr_t> references() const
+	{
+		auto const word = m_shared.load(std::memory_order_acquire);
+		auto const shared = (word & ~(merged_flag | queued_flag)) / count_one;
+		if (m_home && m_home == t_rc_queue && !m_merged)
+		{
+			return shared + m_biased;
+		}
+		if (word & merged_flag)
+		{
+			return shared;
+		}
+		return std::nullopt;
+	}
+
+	std::size_t hash() const
+	{
+		auto h = m_hash.load(std::memory_order_relaxed);
+		if (h == 0)
+		{
+			h = hash_values(values());
+			m_hash.store(h, std::memory_order_relaxed);
+		}
+		return h;
+	}
+
+	static std::size_t hash_values(table::values_type const& values);
+	static std::size_t hash_string(std::string const& str);
+
+	void retain()
+	{
+		if (m_home == t_rc_queue && !m_merged)
+		{
+			++m_biased;
+		}
+		else
+		{
+			m_shared.fetch_add(count_one, std::memory_order_relaxed);
+		}
+	}
+
+	void release()
+	{
+		if (m_home == t_rc_queue && !m_merged)
+		{
+			if (--m_biased == 0)
+			{
+				merge(false);
+			}
+			return;
+		}
+
+		auto const word = m_shared.fetch_sub(count_one, std::memory_order_acq_rel) - count_one;
+		if (word == merged_flag)
+		{
+			delete this;
+		}
+		else if (word < 0 && !(word & (merged_flag | queued_flag)))
+		{
+			request_merge(word);
+		}
+	}
+
+	static void adopt_queue();
+
+private:
+	friend struct rc_queue;
+
+	// The shared word holds the count in units of count_one plus two flag bits; the
+	// node is freed by whichever operation leaves it at exactly merged_flag.
+	static constexpr std::intptr_t merged_flag = 1;
+	static constexpr std::intptr_t queued_flag = 2;
+	static constexpr std::intptr_t count_one = 4;
+
+	// Owner side: fold the biased count into the shared one.
+	void merge(bool queued)
+	{
+		auto const delta = static_cast<std::intptr_t>(m_biased) * count_one + merged_flag
+			- (queued ? queued_flag : 0);
+		m_biased = 0;
+		m_merged = true;
+		if (m_shared.fetch_add(delta, std::memory_order_acq_rel) + delta == merged_flag)
+		{
+			delete this;
+		}
+	}
+
+	void request_merge(std::intptr_t word)
+	{
+		while (word < 0 && !(word & (merged_flag | queued_flag)))
+		{
+			if (m_shared.compare_exchange_weak(word, word | queued_flag, std::memory_order_acq_rel))
+			{
+				m_home->push(this);
+				return;
+			}
+		}
+	}
+
+	mutable table::values_type m_values; // written once when decoding a source
+	std::unique_ptr<table_source const> m_source;
+	mutable std::once_flag m_decoded;
+	rc_queue* m_home = nullptr;
+	std::uint32_t m_biased = 0;
+	bool m_merged = false;
+	bool m_interned = false;
+	mutable std::atomic<bool> m_has_values = false;
+	std::atomic<std::intptr_t> m_shared = 0;
+	mutable std::atomic<std::size_t> m_hash = 0; // 0 until computed
+};
+
+
+std::size_t table_node::hash_values(table::values_type const& values)
+{
+	if (auto pstr = std::get_if<std::string>(&values))
+	{
+		return hash_string(*pstr);
+	}
+
+	std::size_t h = 0x2545f4914f6cdd1d;
+	for (auto const& kv : std::get<table::values_map>(values))
+	{
+		h ^= kv.first.hash() + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+		h ^= kv.second.hash() + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+	}
+	return (h == 0) ? 1 : h;
+}
+
+
+std::size_t table_node::hash_string(std::string const& str)
+{
+	auto const h = std::hash<std::string>()(str);
+	return (h == 0) ? 1 : h;
+}
+
+
+void rc_queue::push(table_node* node)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		nodes.push_back(node);
+		pending.store(true, std::memory_order_release);
+		if (alive || draining)
+		{
+			return;
+		}
+		draining = true;
+	}
+
+	// The owning thread is gone: act as the owner until the queue is empty again.
+	drain();
+}
+
+
+void rc_queue::drain()
+{
+	std::vector<table_node*> queued;
+	while (true)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (nodes.empty())
+			{
+				draining = false;
+				return;
+			}
+			queued.clear();
+			queued.swap(nodes);
+			pending.store(false, std::memory_order_relaxed);
+		}
+		merge_all(queued);
+	}
+}
+
+
+void rc_queue::merge_all(std::vector<table_node*> const& queued)
+{
+	for (auto node : queued)
+	{
+		if (node->m_merged)
+		{
+			// Already merged by a release on this thread, only the mark is left.
+			auto const flag = table_node::queued_flag;
+			if (node->m_shared.fetch_sub(flag, std::memory_order_acq_rel) - flag == table_node::merged_flag)
+			{
+				delete node;
+			}
+		}
+		else
+		{
+			node->merge(true);
+		}
+	}
+}
+
+
+// Queues outlive their threads so that late releases always have somewhere to go;
+// dead ones are handed to the next thread that starts allocating. The list is
+// never destroyed: threads can end after static destructors have run.
+struct rc_free_list
+{
+	std::mutex mutex;
+	std::vector<rc_queue*> queues;
+};
+
+rc_free_list& rc_free_queues()
+{
+	static auto* const list = new rc_free_list;
+	return *list;
+}
+
+
+struct rc_queue_holder
+{
+	~rc_queue_holder()
+	{
+		if (auto queue = t_rc_queue)
+		{
+			{
+				std::lock_guard<std::mutex> lock(queue->mutex);
+				queue->alive = false;
+				queue->draining = true;
+			}
+			queue->drain();
+
+			// Our remaining references now go through the shared count.
+			t_rc_queue = nullptr;
+			t_rc_exited = true;
+
+			auto& free_queues = rc_free_queues();
+			std::lock_guard<std::mutex> lock(free_queues.mutex);
+			free_queues.queues.push_back(queue);
+		}
+	}
+};
+
+
+void table_node::adopt_queue()
+{
+	thread_local rc_queue_holder holder;
+
+	rc_queue* queue = nullptr;
+	{
+		auto& free_queues = rc_free_queues();
+		std::lock_guard<std::mutex> lock(free_queues.mutex);
+		for (auto it = begin(free_queues.queues); it != end(free_queues.queues); ++it)
+		{
+			// Skip queues that another thread is draining on behalf of the dead owner.
+			std::lock_guard<std::mutex> queue_lock((*it)->mutex);
+			if (!(*it)->draining)
+			{
+				queue = (*it);
+				queue->alive = true;
+				free_queues.queues.erase(it);
+				break;
+			}
+		}
+	}
+
+	if (!queue)
+	{
+		queue = new rc_queue;
+	}
+	t_rc_queue = queue;
+	queue->drain();
+}
+
+
+inline table::table(char const* value) : table(values_type(value)) {}
+inline table::table(std::string const& value) : table(values_type(value)) {}
+inline table::table(std::initializer_list<values_map::value_type> list) : table(values_type(list)) {}
+inline table::table(values_map values) : table(values_type(std::move(values))) {}
+inline table::table(values_type values) : m_node(new table_node(std::move(values))) {}
+inline table::table(std::unique_ptr<table_source const> source) : m_node(new table_node(std::move(source))) {}
+
+inline table::table(table const& other)
+	: m_node(other.m_node)
+{
+	if (m_node)
+	{
+		REDUCT_COUNT(copies, 1);
+		m_node->retain();
+	}
+}
+
+inline table::table(table&& other) noexcept
+	: m_node(std::exchange(other.m_node, nullptr))
+{
+}
+
+inline table::~table()
+{
+	if (m_node)
+	{
+		m_node->release();
+	}
+}
+
+inline table& table::operator= (table other) noexcept
+{
+	std::swap(m_node, other.m_node);
+	return *this;
+}
+
+inline bool table::operator== (table const& rhs) const
+{
+	REDUCT_COUNT(equal_comparisons, 1);
+	if (m_node == rhs.m_node)
+	{
+		return true;
+	}
+	if (m_node && rhs.m_node && m_node->interned() && rhs.m_node->interned())
+	{
+		return false;
+	}
+	return values() == rhs.values();
+}
+
+extern table const lookup_error;
+
+inline table table::operator[](table const& key) const
+{
+	if (m_node && m_node->source())
+	{
+#ifdef REDUCT_INSTRUMENTATION
+		auto result = m_node->source()->lookup(key);
+		if (result.m_node == lookup_error.m_node)
+		{
+			REDUCT_COUNT(lookup_misses, 1);
+		}
+		else
+		{
+			REDUCT_COUNT(lookup_hits, 1);
+		}
+		return result;
+#else
+		return m_node->source()->lookup(key);
+#endif
+	}
+
+	if (auto pstr = std::get_if<std::string>(&values()))
+	{
+		REDUCT_COUNT(lookup_misses, 1);
+		return "type-error";
+	}
+
+	auto const& values = std::get<values_map>(this->values());
+	auto const it = values.find(key);
+	if (it == cend(values))
+	{
+		REDUCT_COUNT(lookup_misses, 1);
+		return "lookup-error";
+	}
+	REDUCT_COUNT(lookup_hits, 1);
+	return it->second;
+}
+
+inline table table::with(table key, table value) const
+{
+	if (m_node && m_node->source())
+	{
+		if (auto updated = m_node->source()->with(key, value))
+		{
+			return *updated;
+		}
+	}
+
+	assert(!std::holds_alternative<std::string>(values()));
+	REDUCT_TRACE("with");
+	REDUCT_COUNT(with_copies, 1);
+	REDUCT_COUNT(copied_entries, std::get<values_map>(values()).size());
+	values_type new_values = values();
+	std::get<values_map>(new_values).insert_or_assign( key, value );
+	return new_values;
+}
+
+inline table_source const* table::source() const
+{
+	return m_node ? m_node->source() : nullptr;
+}
+
+inline bool table::for_each_source(std::function<void(table const&, table const&)> const& f) const
+{
+	return m_node->source()->for_each(f);
+}
+
+inline bool table::empty() const
+{
+	if (m_node && m_node->source())
+	{
+		return !m_node->source()->is_string() && m_node->source()->size() == 0;
+	}
+
+	if (auto pvals = std::get_if<values_map>(&values()))
+	{
+		return pvals->empty();
+	}
+	return false;
+}
+
+inline bool table::is_string() const
+{
+	if (m_node && m_node->source())
+	{
+		return m_node->source()->is_string();
+	}
+	return std::holds_alternative<std::string>(values());
+}
+
+inline std::size_t table::hash() const
+{
+	static std::size_t const empty_hash = table_node::hash_values(values_map());
+	return m_node ? m_node->hash() : empty_hash;
+}
+
+inline table::values_type const& table::values() const
+{
+	static values_type const empty_values = values_map();
+	return m_node ? m_node->values() : empty_values;
+}
+
+void table::reconcile()
+{
+	if (t_rc_queue && t_rc_queue->pending.load(std::memory_order_acquire))
+	{
+		t_rc_queue->drain();
+	}
+}
+
+
+// Interned values are hash-consed: equal tables share one node, so comparing two
+// of them is a pointer comparison. The pool is split into independently locked
+// shards, and each thread keeps a small direct-mapped cache of recent hits in
+// front of it. Entries are weak: sweep() drops those nobody outside the pool
+// refers to any more, and the front caches do not count as referring.
+class intern_pool
+{
+public:
+	table intern(std::string const& symbol);
+	table intern(char const* symbol) { return intern(std::string(symbol)); }
+	table intern(table const& value);
+
+	// Returns the number of entries dropped.
+	std::size_t sweep();
+
+private:
+	static constexpr std::size_t shard_count = 64;
+	static constexpr std::size_t front_size = 256;
+
+	struct alignas(64) shard
+	{
+		std::mutex mutex;
+		std::unordered_multimap<std::size_t, table> entries;
+	};
+
+	struct front_entry
+	{
+		intern_pool const* pool = nullptr;
+		std::size_t hash = 0;
+		table_node* node = nullptr; // in the pool for as long as the entry is set
+	};
+
+	// Recent hits of one thread. sweep() is the only other user of the mutex,
+	// so taking it is never contended otherwise.
+	struct front_cache
+	{
+		front_cache();
+		~front_cache();
+
+		std::mutex mutex;
+		std::array<front_entry, front_size> entries;
+	};
+
+	struct front_registry
+	{
+		std::mutex mutex;
+		std::vector<front_cache*> caches;
+	};
+
+	template <typename Equal, typename Make>
+	table find_or_insert(std::size_t hash, Equal equal, Make make);
+
+	// Null once the thread's cache is gone, for interning in the destructors
+	// that run after it at thread exit.
+	static front_cache* front()
+	{
+		thread_local front_cache* current = nullptr;
+		thread_local bool exited = false;
+		if (!current && !exited)
+		{
+			thread_local struct owner
+			{
+				front_cache cache;
+
+				~owner()
+				{
+					current = nullptr;
+					exited = true;
+				}
+			} cache_owner;
+			current = &cache_owner.cache;
+		}
+		return current;
+	}
+
+	// Never destroyed, threads can end after static destructors have run.
+	static front_registry& fronts()
+	{
+		static auto* const registry = new front_registry;
+		return *registry;
+	}
+
+	shard& shard_for(std::size_t hash)
+	{
+		return m_shards[(hash >> 8) % shard_count];
+	}
+
+	std::array<shard, shard_count> m_shards;
+	std::mutex m_sweep_mutex;
+	std::atomic<bool> m_sweeping{ false };
+};
+
+
+intern_pool::front_cache::front_cache()
+{
+	auto& registry = fronts();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.caches.push_back(this);
+}
+
+
+intern_pool::front_cache::~front_cache()
+{
+	auto& registry = fronts();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.caches.erase(std::find(begin(registry.caches), end(registry.caches), this));
+}
+
+
+template <typename Equal, typename Make>
+table intern_pool::find_or_insert(std::size_t hash, Equal equal, Make make)
+{
+	auto const cache = front();
+	if (cache)
+	{
+		std::lock_guard<std::mutex> lock(cache->mutex);
+		auto const& cached = cache->entries[hash % front_size];
+		if (cached.pool == this && cached.hash == hash && equal(cached.node->values()))
+		{
+			cached.node->retain();
+			return table(cached.node);
+		}
+	}
+
+	table result;
+	{
+		auto& sh = shard_for(hash);
+		std::lock_guard<std::mutex> lock(sh.mutex);
+		auto const range = sh.entries.equal_range(hash);
+		auto const it = std::find_if(range.first, range.second, [&](auto const& kv) { return equal(kv.second.values()); });
+		if (it != range.second)
+		{
+			result = it->second;
+		}
+		else
+		{
+			result = table(new table_node(make(), table_node::shared_tag{}));
+			sh.entries.emplace(hash, result);
+		}
+	}
+
+	// Not while a sweep is running: it has emptied the caches so that it can
+	// free what they pointed to.
+	if (cache)
+	{
+		std::lock_guard<std::mutex> lock(cache->mutex);
+		if (!m_sweeping.load(std::memory_order_relaxed))
+		{
+			cache->entries[hash % front_size] = { this, hash, result.m_node };
+		}
+	}
+	return result;
+}
+
+
+table intern_pool::intern(std::string const& symbol)
+{
+	auto const hash = table_node::hash_string(symbol);
+	return find_or_insert(hash,
+		[&](table::values_type const& v) { auto pstr = std::get_if<std::string>(&v); return pstr && (*pstr) == symbol; },
+		[&]() { return table::values_type(symbol); });
+}
+
+
+table intern_pool::intern(table const& value)
+{
+	if (!value.m_node || value.m_node->interned())
+	{
+		return value;
+	}
+
+	// Intern bottom-up so that every subtable is shared as well.
+	auto values = value.values();
+	if (auto pvals = std::get_if<table::values_map>(&values))
+	{
+		table::values_map interned_vals;
+		for (auto const& kv : *pvals)
+		{
+			interned_vals.emplace_hint(cend(interned_vals), intern(kv.first), intern(kv.second));
+		}
+		(*pvals) = std::move(interned_vals);
+	}
+
+	auto const hash = table_node::hash_values(values);
+	return find_or_insert(hash,
+		[&](table::values_type const& v) { return v == values; },
+		[&]() { return std::move(values); });
+}
+
+
+std::size_t intern_pool::sweep()
+{
+	REDUCT_TRACE("intern-sweep");
+	std::lock_guard<std::mutex> sweeping(m_sweep_mutex);
+
+	// The front caches hand out references without the shard locks, so they
+	// are emptied first and stay empty until the sweep is over.
+	m_sweeping.store(true, std::memory_order_relaxed);
+	{
+		auto& registry = fronts();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		for (auto cache : registry.caches)
+		{
+			std::lock_guard<std::mutex> cache_lock(cache->mutex);
+			for (auto& entry : cache->entries)
+			{
+				if (entry.pool == this)
+				{
+					entry = front_entry();
+				}
+			}
+		}
+	}
+
+	// Dropping a table can leave its interned children unreferenced, so repeat
+	// until a pass frees nothing.
+	std::size_t total = 0;
+	std::size_t dropped;
+	do
+	{
+		dropped = 0;
+		for (auto& sh : m_shards)
+		{
+			std::vector<table> garbage;
+			{
+				std::lock_guard<std::mutex> lock(sh.mutex);
+				for (auto it = begin(sh.entries); it != end(sh.entries);)
+				{
+					// New references are only handed out under this lock, so a
+					// unique entry stays unique.
+					if (it->second.m_node->unique())
+					{
+						garbage.push_back(std::move(it->second));
+						it = sh.entries.erase(it);
+					}
+					else
+					{
+						++it;
+					}
+				}
+			}
+			// Released outside the lock, children may live in this shard.
+			dropped += garbage.size();
+		}
+		total += dropped;
+	} while (dropped != 0);
+	m_sweeping.store(false, std::memory_order_relaxed);
+	return total;
+}
+
+
+intern_pool& interned()
+{
+	static intern_pool pool;
+	return pool;
+}
+
+
+table intern(std::string const& symbol)
+{
+	return interned().intern(symbol);
+}
+
+
+table intern(char const* symbol)
+{
+	return interned().intern(symbol);
+}
+
+
+table intern(table const& value)
+{
+	return interned().intern(value);
+}
+
+
+// Evaluations the server and batch mode run between sweeps of the pool.
+constexpr std::size_t sweep_interval = 1 << 16;
+
+
+// Dictionary encoding for strings that repeat: every occurrence of a value becomes
+// the one interned node for it, so a repeat costs a pointer and compares by
+// address. The local map spares the shared pool most lookups. Values are only
+// encoded until limit distinct ones have been seen, as a stream of unique values
+// would just fill the pool.
+class string_dictionary
+{
+public:
+	explicit string_dictionary(std::size_t limit = 4096)
+		: m_limit(limit)
+	{
+	}
+
+	table get(std::string const& value)
+	{
+		auto const it = m_codes.find(value);
+		if (it != end(m_codes))
+		{
+			return it->second;
+		}
+		if (m_codes.size() >= m_limit)
+		{
+			return value;
+		}
+		return m_codes.emplace(value, intern(value)).first->second;
+	}
+
+private:
+	std::unordered_map<std::string, table> m_codes;
+	std::size_t m_limit;
+};
+
+
+// Copy of t in which every string that occurs at least min_repeats times, as a key
+// or a value, is dictionary encoded. Strings that already are interned are left
+// out of the count, and only the maps with something encoded in them are copied.
+auto encode_strings(table const& t, std::size_t min_repeats = 2) -> table
+{
+	REDUCT_TRACE("encode-strings");
+	std::unordered_map<std::string_view, std::size_t> counts;
+	std::function<void(table const&)> count = [&](table const& node)
+	{
+		if (!node.m_node || node.m_node->interned())
+		{
+			return;
+		}
+		if (auto pstr = std::get_if<std::string>(&node.values()))
+		{
+			++counts[*pstr];
+			return;
+		}
+		node.for_each([&](table const& key, table const& value)
+		{
+			count(key);
+			count(value);
+		});
+	};
+	count(t);
+
+	std::unordered_map<std::string_view, table> codes;
+	for (auto const& kv : counts)
+	{
+		if (kv.second >= min_repeats)
+		{
+			codes.emplace(kv.first, intern(std::string(kv.first)));
+		}
+	}
+	counts.clear();
+	if (codes.empty())
+	{
+		return t;
+	}
+
+	std::function<table(table const&)> encode = [&](table const& node) -> table
+	{
+		if (!node.m_node || node.m_node->interned())
+		{
+			return node;
+		}
+		if (auto pstr = std::get_if<std::string>(&node.values()))
+		{
+			auto const it = codes.find(*pstr);
+			return (it != end(codes)) ? it->second : node;
+		}
+		table::values_map values;
+		bool changed = false;
+		node.for_each([&](table const& key, table const& value)
+		{
+			auto encoded_key = encode(key);
+			auto encoded_value = encode(value);
+			changed = changed || encoded_key.m_node != key.m_node || encoded_value.m_node != value.m_node;
+			values.emplace_hint(values.end(), std::move(encoded_key), std::move(encoded_value));
+		});
+		return changed ? table(std::move(values)) : node;
+	};
+	return encode(t);
+}
+
+
+table const lookup_error{ "lookup-error" };
+table const read_error{ "read-error" };
+table const io_error{ "io-error" };
+table const format_error{ "format-error" };
+table const type_error{ "type-error" };
+
+
+bool issymbol(char c)
+{
+	return isalnum(c);
+}
+
+
+auto make_error(table const& type, table const& message) -> table
+{
+	return table({
+		{"type", "error"},
+		{"error-type", type},
+		{"message", message}
+	});
+}
+
+
+auto make_lookup_expr(table const& map, table const& key) -> table
+{
+	return table({
+		{"type", "lookup-expression"},
+		{"map", map},
+		{"key", key}
+	});
+}
+
+
+// Immutable rope for long strings. Leaves are slices of strings owned by tables,
+// so slicing and wrapping an existing string copy nothing; inner nodes join two
+// ropes and are kept height balanced (as in an AVL tree), so concatenation and
+// slicing are O(log n) and share every part they do not cut. Short leaves that
+// meet at a join are merged, which keeps appending a character at a time from
+// building a tree of one-character leaves.
+class rope
+{
+public:
+	using ptr = std::shared_ptr<rope const>;
+
+	static constexpr std::size_t merge_size = 256;
+
+	// Rope over a string table, or null for the empty string or a map.
+	static ptr of(table const& t);
+
+	static ptr concat(ptr const& left, ptr const& right)
+	{
+		if (!left)
+		{
+			return right;
+		}
+		if (!right)
+		{
+			return left;
+		}
+		if (left->leaf() && right->leaf() && left->size() + right->size() <= merge_size)
+		{
+			return merge(*left, *right);
+		}
+		if (right->leaf() && !left->leaf() && left->m_right->leaf()
+			&& left->m_right->size() + right->size() <= merge_size)
+		{
+			return concat(left->m_left, merge(*left->m_right, *right));
+		}
+
+		if (left->m_height > right->m_height + 1)
+		{
+			return balance(left->m_left, concat(left->m_right, right));
+		}
+		if (right->m_height > left->m_height + 1)
+		{
+			return balance(concat(left, right->m_left), right->m_right);
+		}
+		return join(left, right);
+	}
+
+	// The nodes not counted before, while the leaves' owners go to tables.
+	void resident(table_source::memory& usage) const
+	{
+		if (!usage.first(this))
+		{
+			return;
+		}
+		usage.backing += sizeof(*this);
+		if (leaf())
+		{
+			usage.tables.push_back(m_owner);
+			return;
+		}
+		m_left->resident(usage);
+		m_right->resident(usage);
+	}
+
+	static ptr slice(ptr const& r, std::size_t pos, std::size_t count)
+	{
+		if (!r || pos >= r->size() || count == 0)
+		{
+			return nullptr;
+		}
+		count = std::min(count, r->size() - pos);
+		if (pos == 0 && count == r->size())
+		{
+			return r;
+		}
+		if (r->leaf())
+		{
+			return make_leaf(r->m_owner, r->m_text.substr(pos, count));
+		}
+
+		auto const left_size = r->m_left->size();
+		if (pos + count <= left_size)
+		{
+			return slice(r->m_left, pos, count);
+		}
+		if (pos >= left_size)
+		{
+			return slice(r->m_right, pos - left_size, count);
+		}
+		return concat(slice(r->m_left, pos, left_size - pos), slice(r->m_right, 0, count - (left_size - pos)));
+	}
+
+	std::size_t size() const
+	{
+		return m_size;
+	}
+
+	void append_to(std::string& out) const
+	{
+		if (leaf())
+		{
+			out.append(m_text);
+			return;
+		}
+		m_left->append_to(out);
+		m_right->append_to(out);
+	}
+
+private:
+	bool leaf() const
+	{
+		return !m_left;
+	}
+
+	static int height(ptr const& r)
+	{
+		return r ? r->m_height : 0;
+	}
+
+	static ptr make_leaf(table owner, std::string_view text)
+	{
+		auto r = std::make_shared<rope>();
+		r->m_owner = std::move(owner);
+		r->m_text = text;
+		r->m_size = text.size();
+		r->m_height = 1;
+		return r;
+	}
+
+	static ptr merge(rope const& left, rope const& right)
+	{
+		std::string text;
+		text.reserve(left.size() + right.size());
+		text.append(left.m_text).append(right.m_text);
+		return of(table(std::move(text)));
+	}
+
+	static ptr join(ptr left, ptr right)
+	{
+		auto r = std::make_shared<rope>();
+		r->m_size = left->size() + right->size();
+		r->m_height = std::max(left->m_height, right->m_height) + 1;
+		r->m_left = std::move(left);
+		r->m_right = std::move(right);
+		return r;
+	}
+
+	// Joins two ropes whose heights differ by at most two, rotating once if needed.
+	static ptr balance(ptr const& left, ptr const& right)
+	{
+		if (height(left) > height(right) + 1)
+		{
+			if (height(left->m_left) >= height(left->m_right))
+			{
+				return join(left->m_left, join(left->m_right, right));
+			}
+			return join(join(left->m_left, left->m_right->m_left), join(left->m_right->m_right, right));
+		}
+		if (height(right) > height(left) + 1)
+		{
+			if (height(right->m_right) >= height(right->m_left))
+			{
+				return join(join(left, right->m_left), right->m_right);
+			}
+			return join(join(left, right->m_left->m_left), join(right->m_left->m_right, right->m_right));
+		}
+		return join(left, right);
+	}
+
+	ptr m_left;
+	ptr m_right;
+	table m_owner;          // leaves: keeps the text alive
+	std::string_view m_text;
+	std::size_t m_size = 0;
+	int m_height = 0;
+};
+
+
+// A string table backed by a rope. Flattened on first use of the whole value,
+// which the node then keeps.
+class rope_source : public table_source
+{
+public:
+	explicit rope_source(rope::ptr r)
+		: m_rope(std::move(r))
+	{
+	}
+
+	rope::ptr const& get() const
+	{
+		return m_rope;
+	}
+
+	bool is_string() const override
+	{
+		return true;
+	}
+
+	std::size_t size() const override
+	{
+		return m_rope->size();
+	}
+
+	table lookup(table const& /*key*/) const override
+	{
+		return "type-error";
+	}
+
+	table::values_type decode() const override
+	{
+		std::string text;
+		text.reserve(m_rope->size());
+		m_rope->append_to(text);
+		return text;
+	}
+
+	void resident(memory& usage) const override
+	{
+		usage.bytes = sizeof(*this);
+		m_rope->resident(usage);
+	}
+
+private:
+	rope::ptr m_rope;
+};
+
+
+rope::ptr rope::of(table const& t)
+{
+	if (auto const source = dynamic_cast<rope_source const*>(t.source()))
+	{
+		return source->get();
+	}
+	auto const pstr = std::get_if<std::string>(&t.values());
+	return (pstr && !pstr->empty()) ? make_leaf(t, *pstr) : nullptr;
+}
+
+
+// Strings shorter than this stay plain.
+constexpr std::size_t rope_threshold = 1024;
+
+
+auto make_string(rope::ptr const& r) -> table
+{
+	if (r && r->size() >= rope_threshold)
+	{
+		return table(std::make_unique<rope_source>(r));
+	}
+	std::string text;
+	if (r)
+	{
+		r->append_to(text);
+	}
+	return text;
+}
+
+
+auto concat(table const& a, table const& b) -> table
+{
+	if (!a.is_string() || !b.is_string())
+	{
+		return make_error(type_error, "concat of a map");
+	}
+	return make_string(rope::concat(rope::of(a), rope::of(b)));
+}
+
+
+auto substring(table const& s, std::size_t pos, std::size_t count) -> table
+{
+	if (!s.is_string())
+	{
+		return make_error(type_error, "substring of a map");
+	}
+	return make_string(rope::slice(rope::of(s), pos, count));
+}
+
+
+// Reads expressions from text that arrives in pieces. Everything the reader is
+// in the middle of — a symbol, a string, the expressions of open parens — is
+// kept between calls to feed(), so each byte is read once however the text is
+// split. In line mode a line break outside parens and strings ends a form, and
+// an error skips the rest of its line; otherwise all of the text is one form.
+class reader
+{
+public:
+	explicit reader(bool line_forms)
+		: m_line_forms(line_forms)
+	{
+	}
+
+	// Reads text, appending the forms it completes to forms.
+	void feed(std::string_view text, std::vector<table>& forms)
+	{
+		REDUCT_COUNT(read_bytes, text.size());
+		auto it = text.begin();
+		auto const last = text.end();
+		while (it != last)
+		{
+			char const c = (*it);
+			if (m_state == state::skip)
+			{
+				it = std::find(it, last, '\n');
+				if (it != last)
+				{
+					m_state = state::normal;
+					++it;
+				}
+			}
+			else if (m_state == state::symbol)
+			{
+				auto const first = it;
+				while (it != last && issymbol(*it))
+				{
+					++it;
+				}
+				m_token.append(first, it);
+				if (it != last)
+				{
+					m_state = state::normal;
+					add(intern(m_token));
+				}
+			}
+			else if (m_state == state::string)
+			{
+				if (c == '"')
+				{
+					m_state = state::normal;
+					add(table(m_token));
+				}
+				else if (c == '\\')
+				{
+					m_state = state::escape;
+				}
+				else
+				{
+					m_token += c;
+				}
+				++it;
+			}
+			else if (m_state == state::escape)
+			{
+				m_state = state::string;
+				m_token += c;
+				++it;
+			}
+			else if (c == '\n' && m_line_forms && m_stack.empty())
+			{
+				++it;
+				if (!m_expr.empty())
+				{
+					forms.push_back(std::move(m_expr));
+					m_expr = table();
+				}
+			}
+			else if (isspace(c))
+			{
+				++it;
+			}
+			else if (issymbol(c))
+			{
+				m_state = state::symbol;
+				m_token.clear();
+			}
+			else if (c == '(')
+			{
+				++it;
+				REDUCT_COUNT(read_tokens, 1);
+				m_stack.push(m_expr);
+				m_expr = table();
+			}
+			else if (c == ')' && !m_stack.empty())
+			{
+				++it;
+				REDUCT_COUNT(read_tokens, 1);
+				table parent = m_stack.top();
+				m_stack.pop();
+				if (m_expr.empty())
+				{
+					// () is essentially whitespace, it is not an evaluated lookup. 
+					//TODO: Should this be an error?
+					m_expr = parent;
+				}
+				else if (!parent.empty())
+				{
+					// Only make a lookup expression if the parent should be considered a 
+					// map, otherwise read("(1)") becomes the lookup '({} 1)'.
+					m_expr = make_lookup_expr(parent, m_expr);
+				}
+			}
+			else if (c == '"')
+			{
+				++it;
+				m_state = state::string;
+				m_token.clear();
+			}
+			else
+			{
+				fail(make_error(read_error, std::string("Unexpected '") + c + "'"), forms);
+				if (!m_line_forms)
+				{
+					return;
+				}
+			}
+		}
+	}
+
+	// Ends the text: returns the form in progress, or an error if it is
+	// incomplete.
+	table finish()
+	{
+		if (m_state == state::symbol)
+		{
+			m_state = state::normal;
+			add(intern(m_token));
+		}
+
+		table result;
+		if (!m_error.empty())
+		{
+			result = m_error;
+		}
+		else if (m_state == state::string || m_state == state::escape)
+		{
+			result = make_error(read_error, "Missing closing '\"'");
+		}
+		else if (!m_stack.empty())
+		{
+			result = make_error(read_error, "Missing ')'");
+		}
+		else
+		{
+			result = m_expr;
+		}
+		reset();
+		return result;
+	}
+
+	// Whether a form has been started and not finished.
+	bool pending() const
+	{
+		return !m_expr.empty() || !m_stack.empty() || (m_state != state::normal && m_state != state::skip);
+	}
+
+private:
+	enum class state
+	{
+		normal,
+		symbol,
+		string,
+		escape,
+		skip,
+	};
+
+	void add(table const& atom)
+	{
+		REDUCT_COUNT(read_tokens, 1);
+		m_expr = m_expr.empty() ? atom : make_lookup_expr(m_expr, atom);
+	}
+
+	void fail(table const& error, std::vector<table>& forms)
+	{
+		reset();
+		if (m_line_forms)
+		{
+			forms.push_back(error);
+			m_state = state::skip;
+		}
+		else
+		{
+			m_error = error;
+			m_state = state::skip;
+		}
+	}
+
+	void reset()
+	{
+		m_error = table();
+		m_expr = table();
+		m_stack = std::stack<table>();
+		m_token.clear();
+		m_state = state::normal;
+	}
+
+	bool const m_line_forms;
+	state m_state = state::normal;
+	table m_expr;
+	std::stack<table> m_stack;
+	std::string m_token;
+	table m_error;
+};
+
+
+auto read(std::string const& input) -> table
+{
+	REDUCT_TRACE("read");
+	reader in(false);
+	std::vector<table> forms;
+	in.feed(input, forms);
+	return in.finish();
+}
+
+
+// The results of read() for recently seen input, so text that comes in over and
+// over is parsed once. Slots are direct mapped by a hash of the text and checked
+// against the text itself; a new text takes over the slot it maps to. A parsed
+// expression is an immutable table, so every thread can evaluate the same one.
+class parse_cache
+{
+public:
+	table parse(std::string const& input)
+	{
+		if (input.size() > max_input)
+		{
+			auto& sh = m_shards[0];
+			std::lock_guard<std::mutex> lock(sh.mutex);
+			++sh.misses;
+		}
+		else
+		{
+			auto const hash = std::hash<std::string>()(input);
+			auto& sh = m_shards[(hash >> 8) % shard_count];
+			auto& entry = sh.slots[hash % slots_per_shard];
+			{
+				std::lock_guard<std::mutex> lock(sh.mutex);
+				if (entry.filled && entry.hash == hash && entry.text == input)
+				{
+					++sh.hits;
+					return entry.expr;
+				}
+				++sh.misses;
+			}
+
+			table expr = read(input);
+			std::lock_guard<std::mutex> lock(sh.mutex);
+			entry.filled = true;
+			entry.hash = hash;
+			entry.text = input;
+			entry.expr = expr;
+			return expr;
+		}
+		return read(input);
+	}
+
+	// {hits, misses, entries}
+	auto stats() -> table
+	{
+		std::uint64_t hits = 0;
+		std::uint64_t misses = 0;
+		std::size_t entries = 0;
+		for (auto& sh : m_shards)
+		{
+			std::lock_guard<std::mutex> lock(sh.mutex);
+			hits += sh.hits;
+			misses += sh.misses;
+			entries += static_cast<std::size_t>(std::count_if(sh.slots.begin(), sh.slots.end(), [](slot const& s) { return s.filled; }));
+		}
+		return table({
+			{"hits", std::to_string(hits)},
+			{"misses", std::to_string(misses)},
+			{"entries", std::to_string(entries)}
+		});
+	}
+
+private:
+	static constexpr std::size_t shard_count = 64;
+	static constexpr std::size_t slots_per_shard = 64;
+	static constexpr std::size_t max_input = 1024;
+
+	struct slot
+	{
+		bool filled = false;
+		std::size_t hash = 0;
+		std::string text;
+		table expr;
+	};
+
+	struct alignas(64) shard
+	{
+		std::mutex mutex;
+		std::array<slot, slots_per_shard> slots;
+		std::uint64_t hits = 0;
+		std::uint64_t misses = 0;
+	};
+
+	std::array<shard, shard_count> m_shards;
+};
+
+
+parse_cache& parsed()
+{
+	static parse_cache cache;
+	return cache;
+}
+
+
+std::string pretty(table const& tab)
+{
+	if (auto pstr = tab.as_string())
+	{
+		if (std::any_of(pstr->begin(), pstr->end(), isspace))
+		{
+			return '"' + (*pstr) + '"';
+		}
+		else
+		{
+			return (*pstr);
+		}
+	}
+
+	std::ostringstream out;
+	table const type = tab["type"];
+	if (type == "lookup-expression")
+	{
+		out << "(" << pretty(tab["map"]);
+		if (tab["key"] != "lookup-error")
+		{
+			out << " " << pretty(tab["key"]);
+		}
+		out << ")";
+	}
+	else if (type == "error")
+	{
+		out << *(tab["error-type"].as_string()) << ": " << *(tab["message"].as_string());
+	}
+	else
+	{
+		out << "{";
+		char const* sep = "";
+		auto const vals = (*tab.as_values());
+		for (auto kv : vals)
+		{
+			out << sep << pretty(kv.first) << " = " << pretty(kv.second);
+			sep = ", ";
+		}
+		out << "}";
+	}
+	return out.str();
+}
+
+
+std::ostream& operator<<(std::ostream& out, table const& t)
+{
+	REDUCT_TRACE("print");
+	auto const text = pretty(t);
+	REDUCT_COUNT(printed_bytes, text.size());
+	out << text;
+	return out;
+}
+
+
+// Appends what operator<< would print for t to out.
+void print_to(std::string& out, table const& t)
+{
+	REDUCT_TRACE("print");
+	[[maybe_unused]] auto const size = out.size();
+	out += pretty(t);
+	REDUCT_COUNT(printed_bytes, out.size() - size);
+}
+
+
+// Read-only mapping of a whole file.
+class mapped_file
+{
+public:
+	enum class access { random, sequential };
+
+	explicit mapped_file(std::string const& path, access pattern = access::random)
+	{
+#ifdef _WIN32
+		m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+		{
+			return;
+		}
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size))
+		{
+			return;
+		}
+		m_size = static_cast<std::size_t>(size.QuadPart);
+		m_open = true;
+		if (m_size != 0)
+		{
+			m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			m_data = m_mapping ? static_cast<char const*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+			m_open = (m_data != nullptr);
+		}
+#else
+		int const fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			return;
+		}
+		struct stat st;
+		if (::fstat(fd, &st) == 0)
+		{
+			m_size = static_cast<std::size_t>(st.st_size);
+			m_open = true;
+			if (m_size != 0)
+			{
+				void* const data = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+				m_data = (data == MAP_FAILED) ? nullptr : static_cast<char const*>(data);
+				m_open = (m_data != nullptr);
+#if defined(MADV_RANDOM) && defined(MADV_SEQUENTIAL)
+				// Lookups jump around the file, read-ahead would only inflate the
+				// resident set with pages nobody asked for. Parsers read it front to
+				// back and want as much read-ahead as they can get.
+				if (m_data)
+				{
+					::madvise(data, m_size, (pattern == access::random) ? MADV_RANDOM : MADV_SEQUENTIAL);
+				}
+#endif
+			}
+		}
+		::close(fd);
+#endif
+	}
+
+	~mapped_file()
+	{
+#ifdef _WIN32
+		if (m_data)
+		{
+			UnmapViewOfFile(m_data);
+		}
+		if (m_mapping)
+		{
+			CloseHandle(m_mapping);
+		}
+		if (m_file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(m_file);
+		}
+#else
+		if (m_data)
+		{
+			::munmap(const_cast<char*>(m_data), m_size);
+		}
+#endif
+	}
+
+	mapped_file(mapped_file const&) = delete;
+	mapped_file& operator= (mapped_file const&) = delete;
+
+	bool is_open() const
+	{
+		return m_open;
+	}
+
+	char const* data() const
+	{
+		return m_data;
+	}
+
+	std::size_t size() const
+	{
+		return m_size;
+	}
+
+	// Bytes of the mapping in memory now; all of it where the system cannot say.
+	std::size_t resident_bytes() const
+	{
+#ifdef _WIN32
+		return m_size;
+#else
+		if (!m_data)
+		{
+			return 0;
+		}
+		auto const page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+		std::vector<unsigned char> pages((m_size + page - 1) / page);
+		if (::mincore(const_cast<char*>(m_data), m_size, pages.data()) != 0)
+		{
+			return m_size;
+		}
+		auto const resident = static_cast<std::size_t>(std::count_if(begin(pages), end(pages), [](unsigned char p) { return p & 1; }));
+		return std::min(m_size, resident * page);
+#endif
+	}
+
+private:
+	char const* m_data = nullptr;
+	std::size_t m_size = 0;
+	bool m_open = false;
+#ifdef _WIN32
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = nullptr;
+#endif
+};
+
+
+// Binary image format. Nodes are written children first, so every reference
+// points backwards, and shared nodes are written once. String keys of maps are
+// stored once in a key dictionary and referenced by index.
+//
+//   string  = 0x00 varint(length) bytes
+//   bstring = 0x04 varint(block) varint(offset) varint(length), in a string block
+//   map     = 0x03 u8 widths varint(count) count * (key, value)
+//   map32   = 0x01 varint(count) count * (u32 key, u32 value), older images
+//   map64   = 0x02 varint(count) count * (u64 key, u64 value), older images
+//   chunks  = 0x05 u8 widths varint(count) varint(parts) parts * (key, part)
+//   key     = (dictionary index << 1) for strings, (node offset << 1) | 1 otherwise
+//   trailer = u64 root, u64 dictionary index, u64 key count,
+//             u64 block index, u64 block count, "RDCTIMG2"
+//
+// The dictionary index is an array of u64 offsets to varint-prefixed key strings,
+// and the block index has a u64 offset, u32 stored size and u32 size per block.
+// Map entries are fixed width within a map, the narrowest of 1, 2, 4 or 8 bytes
+// that fits its key and value references (log2 of each in the high and low nibble
+// of widths), so keys early in the dictionary cost a byte. Entries are in key
+// order and lookups on a mapped image are a binary search that only touches the
+// pages along the way. Integers are little endian.
+//
+// String blocks are optional: long strings are then packed together into blocks
+// that are compressed separately, so any string can be read by decompressing just
+// its block.
+//
+// Chunks are optional too: a large map is then split into parts, maps or chunks
+// records themselves, listed in key order by their first key. count is the
+// number of entries in all of them.
+namespace binary_format
+{
+	constexpr std::uint8_t tag_string = 0;
+	constexpr std::uint8_t tag_map32 = 1;
+	constexpr std::uint8_t tag_map64 = 2;
+	constexpr std::uint8_t tag_map = 3;
+	constexpr std::uint8_t tag_block_string = 4;
+	constexpr std::uint8_t tag_chunks = 5;
+	constexpr char magic_v1[8] = { 'R', 'D', 'C', 'T', 'I', 'M', 'G', '1' };
+	constexpr char magic[8] = { 'R', 'D', 'C', 'T', 'I', 'M', 'G', '2' };
+	constexpr std::size_t trailer_size_v1 = 32;
+	constexpr std::size_t trailer_size = 48;
+
+	// Bytes needed to store value, as log2.
+	inline std::uint8_t width_log2(std::uint64_t value)
+	{
+		return (value <= 0xff) ? 0 : (value <= 0xffff) ? 1 : (value <= 0xffffffff) ? 2 : 3;
+	}
+
+	// Integers are stored little endian; on little-endian machines, which is all
+	// that MSVC targets, that is a plain copy.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	constexpr bool native_order = false;
+#else
+	constexpr bool native_order = true;
+#endif
+
+	inline void append_uint(std::string& out, std::uint64_t value, std::size_t width)
+	{
+		if (native_order)
+		{
+			out.append(reinterpret_cast<char const*>(&value), width);
+			return;
+		}
+		for (std::size_t i = 0; i < width; ++i)
+		{
+			out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+		}
+	}
+
+	inline std::uint64_t load_uint(char const* p, std::size_t width)
+	{
+		std::uint64_t value = 0;
+		if (native_order)
+		{
+			std::memcpy(&value, p, width);
+			return value;
+		}
+		for (std::size_t i = 0; i < width; ++i)
+		{
+			value |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(p[i])) << (8 * i);
+		}
+		return value;
+	}
+
+	template <typename T>
+	T load(char const* p)
+	{
+		return static_cast<T>(load_uint(p, sizeof(T)));
+	}
+
+	inline void write_uint(std::ostream& out, std::uint64_t value, std::size_t width = 8)
+	{
+		std::string bytes;
+		append_uint(bytes, value, width);
+		out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+	}
+
+	inline void append_varint(std::string& out, std::uint64_t value)
+	{
+		do
+		{
+			auto byte = static_cast<std::uint8_t>(value & 0x7f);
+			value >>= 7;
+			if (value)
+			{
+				byte |= 0x80;
+			}
+			out.push_back(static_cast<char>(byte));
+		} while (value);
+	}
+
+	inline std::uint64_t load_varint(char const*& p, char const* last)
+	{
+		std::uint64_t value = 0;
+		for (int shift = 0; p != last && shift < 64; shift += 7)
+		{
+			auto const byte = static_cast<std::uint8_t>(*p++);
+			value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+			{
+				break;
+			}
+		}
+		return value;
+	}
+}
+
+
+// Self-contained encoding of a single table, without offsets or a dictionary, for
+// records that are written and read one at a time:
+//
+//   string = 0x00 varint(length) bytes
+//   map    = 0x01 varint(count) count * (key, value)
+void write_inline(table const& t, std::string& out)
+{
+	if (auto pstr = t.as_string())
+	{
+		out.push_back(static_cast<char>(binary_format::tag_string));
+		binary_format::append_varint(out, pstr->size());
+		out.append(*pstr);
+		return;
+	}
+
+	std::size_t count = 0;
+	t.for_each([&](table const&, table const&) { ++count; });
+	out.push_back(static_cast<char>(binary_format::tag_map32));
+	binary_format::append_varint(out, count);
+	t.for_each([&](table const& key, table const& value)
+	{
+		write_inline(key, out);
+		write_inline(value, out);
+	});
+}
+
+
+// Returns nullopt if the input is truncated or malformed.
+std::optional<table> read_inline(char const*& p, char const* last)
+{
+	if (p == last)
+	{
+		return std::nullopt;
+	}
+
+	auto const tag = static_cast<std::uint8_t>(*p++);
+	auto const count = binary_format::load_varint(p, last);
+	if (tag == binary_format::tag_string)
+	{
+		if (static_cast<std::uint64_t>(last - p) < count)
+		{
+			return std::nullopt;
+		}
+		std::string str(p, static_cast<std::size_t>(count));
+		p += count;
+		return table(str);
+	}
+	if (tag != binary_format::tag_map32)
+	{
+		return std::nullopt;
+	}
+
+	table::values_map values;
+	for (std::uint64_t i = 0; i < count; ++i)
+	{
+		auto key = read_inline(p, last);
+		auto value = key ? read_inline(p, last) : std::nullopt;
+		if (!value)
+		{
+			return std::nullopt;
+		}
+		values.emplace_hint(cend(values), std::move(*key), std::move(*value));
+	}
+	return table(std::move(values));
+}
+
+
+// Small LZ77 codec for string blocks, in the style of LZ4: a sequence is a token
+// (literal count and match length - 4, four bits each, 15 meaning more bytes
+// follow), the literals, and a u16 distance back to the match. The last sequence
+// has literals only.
+namespace lz
+{
+	constexpr std::size_t min_match = 4;
+
+	inline void put_length(std::string& out, std::size_t length)
+	{
+		for (; length >= 255; length -= 255)
+		{
+			out.push_back(static_cast<char>(255));
+		}
+		out.push_back(static_cast<char>(length));
+	}
+
+	inline void put_sequence(std::string& out, std::string_view literals, std::size_t distance, std::size_t match)
+	{
+		auto const lit = std::min<std::size_t>(literals.size(), 15);
+		auto const len = (match == 0) ? 0 : std::min<std::size_t>(match - min_match, 15);
+		out.push_back(static_cast<char>((lit << 4) | len));
+		if (lit == 15)
+		{
+			put_length(out, literals.size() - 15);
+		}
+		out.append(literals);
+		if (match != 0)
+		{
+			out.push_back(static_cast<char>(distance & 0xff));
+			out.push_back(static_cast<char>(distance >> 8));
+			if (len == 15)
+			{
+				put_length(out, match - min_match - 15);
+			}
+		}
+	}
+
+	inline std::string compress(std::string_view in)
+	{
+		std::string out;
+		std::vector<std::uint32_t> recent(1 << 12, UINT32_MAX);
+		std::size_t anchor = 0;
+		std::size_t i = 0;
+		while (i + min_match <= in.size())
+		{
+			std::uint32_t word;
+			std::memcpy(&word, in.data() + i, sizeof(word));
+			auto& slot = recent[(word * 2654435761u) >> 20];
+			std::size_t const candidate = slot;
+			slot = static_cast<std::uint32_t>(i);
+
+			if (candidate == UINT32_MAX || i - candidate > 0xffff || std::memcmp(in.data() + candidate, in.data() + i, min_match) != 0)
+			{
+				++i;
+				continue;
+			}
+
+			std::size_t match = min_match;
+			while (i + match < in.size() && in[candidate + match] == in[i + match])
+			{
+				++match;
+			}
+			put_sequence(out, in.substr(anchor, i - anchor), i - candidate, match);
+			i += match;
+			anchor = i;
+		}
+		put_sequence(out, in.substr(anchor), 0, 0);
+		return out;
+	}
+
+	// Returns false if the input is malformed or does not expand to size bytes.
+	inline bool decompress(char const* p, std::size_t size, std::string& out, std::size_t expected)
+	{
+		auto const last = p + size;
+		auto get_length = [&](std::size_t length)
+		{
+			for (std::uint8_t more = 255; more == 255 && p != last; length += more)
+			{
+				more = static_cast<std::uint8_t>(*p++);
+			}
+			return length;
+		};
+
+		out.clear();
+		out.reserve(expected);
+		while (p != last)
+		{
+			auto const token = static_cast<std::uint8_t>(*p++);
+			auto literals = std::size_t(token >> 4);
+			if (literals == 15)
+			{
+				literals = get_length(literals);
+			}
+			if (static_cast<std::size_t>(last - p) < literals)
+			{
+				return false;
+			}
+			out.append(p, literals);
+			p += literals;
+			if (p == last)
+			{
+				break;
+			}
+
+			if (last - p < 2)
+			{
+				return false;
+			}
+			auto const distance = static_cast<std::size_t>(static_cast<std::uint8_t>(p[0]) | (static_cast<std::uint8_t>(p[1]) << 8));
+			p += 2;
+			auto match = std::size_t(token & 0x0f);
+			if (match == 15)
+			{
+				match = get_length(match);
+			}
+			match += min_match;
+			if (distance == 0 || distance > out.size() || out.size() + match > expected)
+			{
+				return false;
+			}
+			// Byte by byte, the match may overlap what it produces.
+			auto from = out.size() - distance;
+			for (std::size_t k = 0; k < match; ++k)
+			{
+				out.push_back(out[from + k]);
+			}
+		}
+		return out.size() == expected;
+	}
+}
+
+
+struct binary_options
+{
+	// Keys are numbered in order of how often they occur in the sample, so that the
+	// most common ones get the smallest references. Otherwise in order of use.
+	table dictionary_sample;
+
+	// Pack strings of at least block_min_string bytes into compressed blocks.
+	bool compress_strings = false;
+	std::size_t block_size = 64 * 1024;
+	std::size_t block_min_string = 16;
+
+	// Split maps of more than four times chunk_entries entries into parts of
+	// about chunk_entries each; 0 keeps every map in one record, and 1 counts
+	// as 2, the smallest size that parts can be cut to.
+	std::size_t chunk_entries = 0;
+};
+
+
+class binary_writer
+{
+public:
+	explicit binary_writer(std::ostream& out, std::uint64_t offset = 0, binary_options options = {})
+		: m_out(out)
+		, m_offset(offset)
+		, m_options(std::move(options))
+	{
+	}
+
+	virtual ~binary_writer() = default;
+
+	// Writes a self-contained image: the nodes, the key dictionary and the trailer.
+	bool write(table const& root)
+	{
+		train_dictionary();
+		auto const root_offset = write_node(root);
+		flush_block();
+
+		std::vector<std::uint64_t> key_offsets;
+		key_offsets.reserve(m_keys.size());
+		for (auto key : m_keys)
+		{
+			key_offsets.push_back(put_key(*key));
+		}
+
+		auto const dictionary = m_offset;
+		std::string tail;
+		for (auto offset : key_offsets)
+		{
+			append(tail, offset);
+		}
+		auto const blocks = dictionary + key_offsets.size() * 8;
+		for (auto const& block : m_blocks)
+		{
+			append(tail, block.offset);
+			append(tail, block.stored);
+			append(tail, block.size);
+		}
+		append(tail, root_offset);
+		append(tail, dictionary);
+		append(tail, static_cast<std::uint64_t>(m_keys.size()));
+		append(tail, blocks);
+		append(tail, static_cast<std::uint64_t>(m_blocks.size()));
+		tail.append(binary_format::magic, sizeof(binary_format::magic));
+		put_bytes(tail.data(), tail.size());
+
+		m_out.flush();
+		return static_cast<bool>(m_out);
+	}
+
+protected:
+	// Encodes a node once its children are written, and emits the record.
+	std::uint64_t write_node(table const& t)
+	{
+		if (t.m_node)
+		{
+			auto const it = m_written.find(t.m_node);
+			if (it != cend(m_written))
+			{
+				return it->second.second;
+			}
+		}
+
+		std::string record;
+		if (auto pstr = std::get_if<std::string>(&t.values()))
+		{
+			if (m_options.compress_strings && pstr->size() >= m_options.block_min_string)
+			{
+				if (!m_block.empty() && m_block.size() + pstr->size() > m_options.block_size)
+				{
+					flush_block();
+				}
+				record.push_back(static_cast<char>(binary_format::tag_block_string));
+				append_varint(record, m_blocks.size());
+				append_varint(record, m_block.size());
+				append_varint(record, pstr->size());
+				m_block.append(*pstr);
+			}
+			else
+			{
+				record.push_back(static_cast<char>(binary_format::tag_string));
+				append_varint(record, pstr->size());
+				record.append(*pstr);
+			}
+		}
+		else
+		{
+			std::vector<std::pair<std::uint64_t, std::uint64_t>> entries;
+			t.for_each([&](table const& key, table const& value)
+			{
+				auto const k = key_ref(key);
+				entries.emplace_back(k, write_node(value));
+			});
+			auto const chunk = chunk_target();
+			record = (chunk != 0 && entries.size() > 4 * chunk) ? chunks_record(entries) : map_record(entries);
+		}
+
+		auto const offset = emit(record);
+		if (t.m_node)
+		{
+			m_written.emplace(t.m_node, std::make_pair(t, offset));
+		}
+		return offset;
+	}
+
+	// Appends a finished node record and returns its offset.
+	virtual std::uint64_t emit(std::string const& record)
+	{
+		auto const offset = m_offset;
+		put_bytes(record.data(), record.size());
+		return offset;
+	}
+
+	// Number of the key in the dictionary.
+	virtual std::uint64_t key_id(std::string const& key)
+	{
+		auto const it = m_key_ids.try_emplace(key, m_keys.size()).first;
+		if (it->second == m_keys.size())
+		{
+			m_keys.push_back(&it->first);
+		}
+		return it->second;
+	}
+
+	// Writes a dictionary entry and returns its offset.
+	std::uint64_t put_key(std::string const& key)
+	{
+		auto const offset = m_offset;
+		std::string entry;
+		append_varint(entry, key.size());
+		entry.append(key);
+		put_bytes(entry.data(), entry.size());
+		return offset;
+	}
+
+	void put_bytes(char const* data, std::size_t size)
+	{
+		m_out.write(data, static_cast<std::streamsize>(size));
+		m_offset += size;
+	}
+
+	// Offset the next record goes to.
+	std::uint64_t end_offset() const
+	{
+		return m_offset;
+	}
+
+	// Nodes already written, kept alive so their addresses cannot be reused.
+	void forget_written()
+	{
+		m_written.clear();
+	}
+
+	std::size_t written_count() const
+	{
+		return m_written.size();
+	}
+
+	template <typename T>
+	static void append(std::string& out, T value)
+	{
+		binary_format::append_uint(out, value, sizeof(T));
+	}
+
+	static void append_varint(std::string& out, std::uint64_t value)
+	{
+		binary_format::append_varint(out, value);
+	}
+
+private:
+	void train_dictionary()
+	{
+		if (m_options.dictionary_sample.empty())
+		{
+			return;
+		}
+
+		std::unordered_map<std::string, std::size_t> counts;
+		std::function<void(table const&)> count_keys = [&](table const& t)
+		{
+			t.for_each([&](table const& key, table const& value)
+			{
+				if (auto pstr = key.as_string())
+				{
+					++counts[*pstr];
+				}
+				count_keys(value);
+			});
+		};
+		count_keys(m_options.dictionary_sample);
+
+		std::vector<std::pair<std::size_t, std::string>> ranked;
+		for (auto& kv : counts)
+		{
+			ranked.emplace_back(kv.second, kv.first);
+		}
+		std::sort(begin(ranked), end(ranked), [](auto const& a, auto const& b)
+		{
+			return (a.first != b.first) ? a.first > b.first : a.second < b.second;
+		});
+		for (auto const& kv : ranked)
+		{
+			key_id(kv.second);
+		}
+	}
+
+	void flush_block()
+	{
+		if (m_block.empty())
+		{
+			return;
+		}
+		auto const compressed = lz::compress(m_block);
+		m_blocks.push_back({ m_offset, static_cast<std::uint32_t>(compressed.size()), static_cast<std::uint32_t>(m_block.size()) });
+		put_bytes(compressed.data(), compressed.size());
+		m_block.clear();
+	}
+
+	// A map record of the entries, or with total the chunks record listing the
+	// parts of a larger map.
+	static std::string map_record(std::vector<std::pair<std::uint64_t, std::uint64_t>> const& entries,
+		std::optional<std::uint64_t> total = std::nullopt)
+	{
+		std::uint64_t largest_key = 0;
+		std::uint64_t largest_value = 0;
+		for (auto const& kv : entries)
+		{
+			largest_key = std::max(largest_key, kv.first);
+			largest_value = std::max(largest_value, kv.second);
+		}
+
+		std::string record;
+		auto const key_width = binary_format::width_log2(largest_key);
+		auto const value_width = binary_format::width_log2(largest_value);
+		record.push_back(static_cast<char>(total ? binary_format::tag_chunks : binary_format::tag_map));
+		record.push_back(static_cast<char>((key_width << 4) | value_width));
+		if (total)
+		{
+			append_varint(record, *total);
+		}
+		append_varint(record, entries.size());
+		for (auto const& kv : entries)
+		{
+			binary_format::append_uint(record, kv.first, std::size_t(1) << key_width);
+			binary_format::append_uint(record, kv.second, std::size_t(1) << value_width);
+		}
+		return record;
+	}
+
+	std::size_t chunk_target() const
+	{
+		auto const chunk = m_options.chunk_entries;
+		return (chunk == 0) ? 0 : std::max<std::size_t>(chunk, 2);
+	}
+
+	// Emits the entries as parts and returns the chunks record that lists them,
+	// with as many levels of chunks records between as it takes to keep each one
+	// small. A part ends after a key whose hash says so, or at four times the
+	// target size: the cuts stay with the keys, so a changed entry changes only
+	// the records on its way up and the others are stored once for all versions.
+	std::string chunks_record(std::vector<std::pair<std::uint64_t, std::uint64_t>> const& entries)
+	{
+		struct part
+		{
+			std::uint64_t key;
+			std::uint64_t offset;
+			std::uint64_t count;
+		};
+
+		auto const target = chunk_target();
+		std::vector<part> level;
+		level.reserve(entries.size());
+		for (auto const& kv : entries)
+		{
+			level.push_back({ kv.first, kv.second, 1 });
+		}
+
+		std::vector<std::pair<std::uint64_t, std::uint64_t>> slice;
+		for (std::uint64_t depth = 0; depth == 0 || level.size() > 4 * target; ++depth)
+		{
+			std::vector<part> parents;
+			std::uint64_t count = 0;
+			for (std::size_t i = 0; i < level.size(); ++i)
+			{
+				slice.emplace_back(level[i].key, level[i].offset);
+				count += level[i].count;
+
+				// A splitmix64 finalizer, seeded by the depth so that the levels cut
+				// independently.
+				auto h = level[i].key + 0x9e3779b97f4a7c15 * (depth + 1);
+				h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+				h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+				h ^= h >> 31;
+				// Parts hold two entries at least, so every level is smaller than the
+				// one below.
+				if ((h % target == 0 && slice.size() > 1) || slice.size() == 4 * target || i + 1 == level.size())
+				{
+					auto const record = (depth == 0) ? map_record(slice) : map_record(slice, count);
+					parents.push_back({ slice.front().first, emit(record), count });
+					slice.clear();
+					count = 0;
+				}
+			}
+			level = std::move(parents);
+		}
+
+		std::uint64_t total = 0;
+		for (auto const& p : level)
+		{
+			slice.emplace_back(p.key, p.offset);
+			total += p.count;
+		}
+		return map_record(slice, total);
+	}
+
+	std::uint64_t key_ref(table const& key)
+	{
+		if (auto pstr = std::get_if<std::string>(&key.values()))
+		{
+			return key_id(*pstr) << 1;
+		}
+		return (write_node(key) << 1) | 1;
+	}
+
+private:
+	std::ostream& m_out;
+	std::uint64_t m_offset = 0;
+	std::unordered_map<table_node const*, std::pair<table, std::uint64_t>> m_written;
+	std::unordered_map<std::string, std::uint64_t> m_key_ids;
+	std::vector<std::string const*> m_keys;
+
+	struct block_entry
+	{
+		std::uint64_t offset;
+		std::uint32_t stored;
+		std::uint32_t size;
+	};
+
+	binary_options m_options;
+	std::string m_block;
+	std::vector<block_entry> m_blocks;
+};
+
+
+bool write_binary(table const& root, std::ostream& out, binary_options const& options = {})
+{
+	REDUCT_TRACE("write-binary");
+	return binary_writer(out, 0, options).write(root);
+}
+
+
+bool save_binary(table const& root, std::string const& path, binary_options const& options = {})
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	return out && write_binary(root, out, options);
+}
+
+
+// A binary image mapped into memory. Tables loaded from it are views that decode
+// entries on access and keep the image alive. The key dictionary is normally part
+// of the image, but can come from a separate index file (see table_store).
+class binary_image : public std::enable_shared_from_this<binary_image>
+{
+public:
+	explicit binary_image(std::string const& path)
+		: m_file(std::make_unique<mapped_file>(path))
+	{
+	}
+
+	binary_image(std::string const& path, std::string const& keys_path)
+		: m_file(std::make_unique<mapped_file>(path))
+		, m_keys_file(std::make_unique<mapped_file>(keys_path))
+	{
+	}
+
+	// Opens a self-contained image, the root is named by the trailer.
+	table open()
+	{
+		using namespace binary_format;
+		if (!m_file->is_open())
+		{
+			return make_error(io_error, "Cannot map file");
+		}
+
+		// An empty file maps to null, so nothing may be computed from the data
+		// before the size is known to hold a trailer.
+		auto const size = m_file->size();
+		if (size < trailer_size_v1)
+		{
+			return make_error(format_error, "Not a binary image");
+		}
+
+		auto const tail = m_file->data() + size - sizeof(magic);
+		std::size_t trailer_bytes = 0;
+		if (size >= trailer_size && std::memcmp(tail, magic, sizeof(magic)) == 0)
+		{
+			trailer_bytes = trailer_size;
+		}
+		else if (std::memcmp(tail, magic_v1, sizeof(magic_v1)) == 0)
+		{
+			trailer_bytes = trailer_size_v1;
+		}
+		else
+		{
+			return make_error(format_error, "Not a binary image");
+		}
+
+		auto const trailer = m_file->data() + size - trailer_bytes;
+		auto const root = load<std::uint64_t>(trailer);
+		auto const dictionary = load<std::uint64_t>(trailer + 8);
+		m_key_count = load<std::uint64_t>(trailer + 16);
+		m_limit = size - trailer_bytes;
+		if (dictionary > m_limit || (m_limit - dictionary) / 8 < m_key_count)
+		{
+			return make_error(format_error, "Corrupt key dictionary");
+		}
+		m_dictionary = m_file->data() + dictionary;
+
+		if (trailer_bytes == trailer_size)
+		{
+			auto const blocks = load<std::uint64_t>(trailer + 24);
+			m_block_count = load<std::uint64_t>(trailer + 32);
+			if (blocks > m_limit || (m_limit - blocks) / 16 < m_block_count)
+			{
+				return make_error(format_error, "Corrupt block index");
+			}
+			m_block_index = m_file->data() + blocks;
+		}
+		return node(root);
+	}
+
+	// Opens the node at root, with the dictionary in the separate keys file.
+	table open(std::uint64_t root)
+	{
+		if (!m_file->is_open() || !m_keys_file || !m_keys_file->is_open())
+		{
+			return make_error(io_error, "Cannot map file");
+		}
+		m_dictionary = m_keys_file->data();
+		m_key_count = m_keys_file->size() / 8;
+		m_limit = m_file->size();
+		return node(root);
+	}
+
+	table node(std::uint64_t offset) const;
+
+	// Decompressed string block, or null if it is corrupt. The most recently used
+	// blocks are kept.
+	std::shared_ptr<std::string const> block(std::uint64_t index) const
+	{
+		if (index >= m_block_count)
+		{
+			return nullptr;
+		}
+
+		std::lock_guard<std::mutex> lock(m_blocks_mutex);
+		auto& slot = m_blocks[index % m_blocks.size()];
+		if (slot.second && slot.first == index)
+		{
+			return slot.second;
+		}
+
+		auto const entry = m_block_index + index * 16;
+		auto const offset = binary_format::load<std::uint64_t>(entry);
+		auto const stored = binary_format::load<std::uint32_t>(entry + 8);
+		auto const size = binary_format::load<std::uint32_t>(entry + 12);
+		auto data = std::make_shared<std::string>();
+		if (offset > m_limit || m_limit - offset < stored || !lz::decompress(at(offset), stored, *data, size))
+		{
+			return nullptr;
+		}
+		slot = { index, data };
+		return data;
+	}
+
+	std::string_view key(std::uint64_t id) const
+	{
+		if (id >= m_key_count)
+		{
+			return {};
+		}
+		auto const offset = binary_format::load<std::uint64_t>(m_dictionary + id * 8);
+		if (!contains(offset))
+		{
+			return {};
+		}
+		auto p = at(offset);
+		auto const size = binary_format::load_varint(p, end());
+		return { p, static_cast<std::size_t>(std::min<std::uint64_t>(size, end() - p)) };
+	}
+
+	char const* at(std::uint64_t offset) const
+	{
+		return m_file->data() + offset;
+	}
+
+	char const* end() const
+	{
+		return m_file->data() + m_limit;
+	}
+
+	bool contains(std::uint64_t offset) const
+	{
+		return offset < m_limit;
+	}
+
+	// The cached blocks and the mapped pages, for the first of the views.
+	void resident(table_source::memory& usage) const
+	{
+		if (!usage.first(this))
+		{
+			return;
+		}
+		usage.backing += sizeof(*this);
+		{
+			std::lock_guard<std::mutex> lock(m_blocks_mutex);
+			for (auto const& slot : m_blocks)
+			{
+				usage.backing += slot.second ? sizeof(std::string) + slot.second->capacity() : 0;
+			}
+		}
+		usage.mapped += m_file->resident_bytes() + (m_keys_file ? m_keys_file->resident_bytes() : 0);
+	}
+
+private:
+	std::unique_ptr<mapped_file> m_file;
+	std::unique_ptr<mapped_file> m_keys_file;
+	char const* m_dictionary = nullptr;
+	std::uint64_t m_key_count = 0;
+	std::uint64_t m_limit = 0;
+	char const* m_block_index = nullptr;
+	std::uint64_t m_block_count = 0;
+	mutable std::mutex m_blocks_mutex;
+	mutable std::array<std::pair<std::uint64_t, std::shared_ptr<std::string const>>, 64> m_blocks;
+};
+
+
+class binary_map_view : public table_source
+{
+public:
+	binary_map_view(std::shared_ptr<binary_image const> image, std::uint64_t offset)
+		: m_image(std::move(image))
+	{
+		auto p = m_image->at(offset);
+		auto const tag = static_cast<std::uint8_t>(*p++);
+		m_chunked = (tag == binary_format::tag_chunks);
+		if ((tag == binary_format::tag_map || m_chunked) && p != m_image->end())
+		{
+			auto const widths = static_cast<std::uint8_t>(*p++);
+			m_key_width = std::size_t(1) << ((widths >> 4) & 3);
+			m_value_width = std::size_t(1) << (widths & 3);
+		}
+		else if (tag == binary_format::tag_map32 || tag == binary_format::tag_map64)
+		{
+			m_key_width = m_value_width = (tag == binary_format::tag_map64) ? 8 : 4;
+		}
+		else
+		{
+			// Not a map: node() reports these, a view on one is empty.
+			return;
+		}
+		m_size = binary_format::load_varint(p, m_image->end());
+		m_count = m_chunked ? binary_format::load_varint(p, m_image->end()) : m_size;
+		m_entries = p;
+		if (static_cast<std::uint64_t>(m_image->end() - m_entries) / entry_size() < m_count)
+		{
+			m_count = m_size = 0;
+		}
+	}
+
+	bool is_string() const override
+	{
+		return false;
+	}
+
+	std::size_t size() const override
+	{
+		return static_cast<std::size_t>(m_size);
+	}
+
+	// Entries of a chunks record are the parts, each under its first key; the
+	// key is in the last part that starts at or before it.
+	table lookup(table const& key) const override
+	{
+		// Binary search in key order: strings before maps, strings bytewise.
+		auto const skey = key.as_string();
+		std::uint64_t first = 0;
+		std::uint64_t count = m_count;
+		while (count > 0)
+		{
+			auto const step = count / 2;
+			auto const mid = first + step;
+			if (compare(mid, key, skey) < 0)
+			{
+				first = mid + 1;
+				count -= step + 1;
+			}
+			else
+			{
+				count = step;
+			}
+		}
+
+		bool const found = (first < m_count && compare(first, key, skey) == 0);
+		if (m_chunked)
+		{
+			return (found || first != 0) ? child(found ? first : first - 1)[key] : lookup_error;
+		}
+		return found ? child(first) : lookup_error;
+	}
+
+	table::values_type decode() const override
+	{
+		table::values_map values;
+		for (std::uint64_t i = 0; i < m_count; ++i)
+		{
+			if (m_chunked)
+			{
+				child(i).for_each([&](table const& key, table const& value) { values.emplace_hint(cend(values), key, value); });
+			}
+			else
+			{
+				values.emplace_hint(cend(values), key_at(i), child(i));
+			}
+		}
+		return values;
+	}
+
+	void resident(memory& usage) const override
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_children_mutex);
+			// A hash node holds the entry and a link, a bucket one link.
+			usage.bytes = sizeof(*this) + m_children.bucket_count() * sizeof(void*)
+				+ m_children.size() * (sizeof(void*) + sizeof(decltype(m_children)::value_type));
+			for (auto const& kv : m_children)
+			{
+				usage.tables.push_back(kv.second);
+			}
+		}
+		m_image->resident(usage);
+	}
+
+private:
+	std::size_t entry_size() const
+	{
+		return m_key_width + m_value_width;
+	}
+
+	std::uint64_t key_ref(std::uint64_t i) const
+	{
+		return binary_format::load_uint(m_entries + i * entry_size(), m_key_width);
+	}
+
+	std::uint64_t value_ref(std::uint64_t i) const
+	{
+		return binary_format::load_uint(m_entries + i * entry_size() + m_key_width, m_value_width);
+	}
+
+	// Values are decoded on first access and then kept, so a chain of lookups
+	// returns the same subtables every time and later comparisons between them
+	// are pointer comparisons.
+	table child(std::uint64_t i) const
+	{
+		std::lock_guard<std::mutex> lock(m_children_mutex);
+		auto const it = m_children.find(i);
+		if (it != cend(m_children))
+		{
+			return it->second;
+		}
+		return m_children.emplace(i, m_image->node(value_ref(i))).first->second;
+	}
+
+	table key_at(std::uint64_t i) const
+	{
+		auto const ref = key_ref(i);
+		if (ref & 1)
+		{
+			return m_image->node(ref >> 1);
+		}
+		return std::string(m_image->key(ref >> 1));
+	}
+
+	// Compares entry i with the key being looked up.
+	int compare(std::uint64_t i, table const& key, std::optional<std::string> const& skey) const
+	{
+		auto const ref = key_ref(i);
+		bool const entry_is_string = !(ref & 1);
+		if (skey && entry_is_string)
+		{
+			return m_image->key(ref >> 1).compare(*skey);
+		}
+		if (skey || entry_is_string)
+		{
+			return entry_is_string ? -1 : 1;
+		}
+
+		auto const entry = m_image->node(ref >> 1);
+		return (entry < key) ? -1 : (key < entry) ? 1 : 0;
+	}
+
+private:
+	std::shared_ptr<binary_image const> m_image;
+	char const* m_entries = nullptr;
+	std::uint64_t m_count = 0; // entries in the record
+	std::uint64_t m_size = 0;  // entries in the map
+	bool m_chunked = false;
+	std::size_t m_key_width = 4;
+	std::size_t m_value_width = 4;
+	mutable std::mutex m_children_mutex;
+	mutable std::unordered_map<std::uint64_t, table> m_children;
+};
+
+
+table binary_image::node(std::uint64_t offset) const
+{
+	if (!contains(offset))
+	{
+		return make_error(format_error, "Node offset out of range");
+	}
+
+	auto p = at(offset);
+	if (*p == binary_format::tag_string)
+	{
+		++p;
+		auto const size = binary_format::load_varint(p, end());
+		return std::string(p, static_cast<std::size_t>(std::min<std::uint64_t>(size, end() - p)));
+	}
+	if (*p == binary_format::tag_block_string)
+	{
+		++p;
+		auto const index = binary_format::load_varint(p, end());
+		auto const start = binary_format::load_varint(p, end());
+		auto const size = binary_format::load_varint(p, end());
+		auto const data = block(index);
+		if (!data || start > data->size() || data->size() - start < size)
+		{
+			return make_error(format_error, "Corrupt string block");
+		}
+		return data->substr(static_cast<std::size_t>(start), static_cast<std::size_t>(size));
+	}
+	if (*p != binary_format::tag_map && *p != binary_format::tag_chunks
+		&& *p != binary_format::tag_map32 && *p != binary_format::tag_map64)
+	{
+		return make_error(format_error, "Unknown node tag");
+	}
+	return table(std::make_unique<binary_map_view>(shared_from_this(), offset));
+}
+
+
+auto load_binary(std::string const& path) -> table
+{
+	REDUCT_TRACE("load-binary");
+	return std::make_shared<binary_image>(path)->open();
+}
+
+
+// Content-addressed store of table versions, kept in a directory:
+//
+//   nodes.bin  node records in the binary image encoding, plus key strings
+//   keys.idx   u64 offset of each key string, the dictionary shared by all versions
+//   index.bin  (u64 hash, u64 offset) of every record
+//   roots.bin  u64 offset of each committed version's root
+//
+// Records refer to their children by offset, so equal subtables produce equal
+// records and are stored once no matter how many versions contain them. Index
+// hits are confirmed by comparing the stored bytes, as the hash is only 64 bits.
+// Loading a version maps the node file and returns a lazy view of its root.
+class table_store
+{
+public:
+	explicit table_store(std::string const& directory);
+
+	bool is_open() const
+	{
+		return m_open;
+	}
+
+	std::uint64_t versions() const
+	{
+		return m_roots.size();
+	}
+
+	// Stores the table as the next version and returns its number, or nothing if
+	// it could not be written, which leaves the store closed.
+	std::optional<std::uint64_t> commit(table const& root);
+
+	table load(std::uint64_t version) const;
+
+private:
+	class writer;
+
+	std::string path(char const* name) const
+	{
+		return (m_directory / name).string();
+	}
+
+	std::uint64_t emit(std::string const& record);
+	std::uint64_t key_id(std::string const& key);
+	bool stored_equals(std::uint64_t offset, std::string const& record);
+
+	static std::uint64_t hash_record(std::string const& record)
+	{
+		std::uint64_t h = 0xcbf29ce484222325;
+		for (char c : record)
+		{
+			h = (h ^ static_cast<std::uint8_t>(c)) * 0x100000001b3;
+		}
+		return h;
+	}
+
+private:
+	// Written nodes are remembered (and kept alive) between commits so unchanged
+	// subtables are not even re-encoded, up to this many.
+	static constexpr std::size_t remembered_nodes = 1 << 20;
+
+	std::filesystem::path m_directory;
+	bool m_open = false;
+	std::ofstream m_nodes;
+	std::uint64_t m_flushed = 0; // nodes before this are in the file
+	std::ifstream m_nodes_in;
+	std::ofstream m_keys;
+	std::ofstream m_index_out;
+	std::ofstream m_roots_out;
+	std::unique_ptr<writer> m_writer;
+	std::unordered_multimap<std::uint64_t, std::uint64_t> m_index;
+	std::unordered_map<std::string, std::uint64_t> m_key_ids;
+	std::vector<std::uint64_t> m_roots;
+};
+
+
+class table_store::writer : public binary_writer
+{
+public:
+	writer(table_store& store, std::uint64_t offset)
+		: binary_writer(store.m_nodes, offset, options())
+		, m_store(store)
+	{
+	}
+
+	std::uint64_t write(table const& root)
+	{
+		auto const offset = write_node(root);
+		if (written_count() > remembered_nodes)
+		{
+			forget_written();
+		}
+		return offset;
+	}
+
+	std::uint64_t append(std::string const& record)
+	{
+		return binary_writer::emit(record);
+	}
+
+	std::uint64_t append_key(std::string const& key)
+	{
+		return put_key(key);
+	}
+
+	using binary_writer::end_offset;
+
+protected:
+	std::uint64_t emit(std::string const& record) override
+	{
+		return m_store.emit(record);
+	}
+
+	std::uint64_t key_id(std::string const& key) override
+	{
+		return m_store.key_id(key);
+	}
+
+private:
+	// Large maps go in parts, so that a version that changes a few entries
+	// stores the parts with those in them rather than the whole map again.
+	static binary_options options()
+	{
+		binary_options result;
+		result.chunk_entries = 8;
+		return result;
+	}
+
+	table_store& m_store;
+};
+
+
+template <typename F>
+void read_u64s(std::string const& path, F f)
+{
+	std::ifstream in(path, std::ios::binary);
+	char value[8];
+	while (in.read(value, sizeof(value)))
+	{
+		f(binary_format::load<std::uint64_t>(value));
+	}
+}
+
+
+table_store::table_store(std::string const& directory)
+	: m_directory(directory)
+{
+	std::error_code ec;
+	std::filesystem::create_directories(m_directory, ec);
+
+	auto const nodes_size = std::filesystem::file_size(path("nodes.bin"), ec);
+	std::uint64_t const limit = ec ? 0 : nodes_size;
+
+	// Anything pointing past the end of the nodes is from an interrupted commit.
+	std::ifstream nodes_in(path("nodes.bin"), std::ios::binary);
+	read_u64s(path("keys.idx"), [&](std::uint64_t offset)
+	{
+		std::string key;
+		nodes_in.clear();
+		nodes_in.seekg(static_cast<std::streamoff>(offset));
+		std::uint64_t size = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			auto const byte = nodes_in.get();
+			if (byte == EOF)
+			{
+				return;
+			}
+			size |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+			{
+				break;
+			}
+		}
+		key.resize(static_cast<std::size_t>(size));
+		if (offset < limit && nodes_in.read(key.data(), key.size()))
+		{
+			m_key_ids.emplace(std::move(key), m_key_ids.size());
+		}
+	});
+
+	std::uint64_t hash = 0;
+	bool have_hash = false;
+	read_u64s(path("index.bin"), [&](std::uint64_t value)
+	{
+		if (!have_hash)
+		{
+			hash = value;
+		}
+		else if (value < limit)
+		{
+			m_index.emplace(hash, value);
+		}
+		have_hash = !have_hash;
+	});
+
+	read_u64s(path("roots.bin"), [&](std::uint64_t offset)
+	{
+		if (offset < limit)
+		{
+			m_roots.push_back(offset);
+		}
+	});
+
+	auto const mode = std::ios::binary | std::ios::app;
+	m_nodes.open(path("nodes.bin"), mode);
+	m_keys.open(path("keys.idx"), mode);
+	m_index_out.open(path("index.bin"), mode);
+	m_roots_out.open(path("roots.bin"), mode);
+	m_nodes_in.open(path("nodes.bin"), std::ios::binary);
+	m_open = m_nodes && m_keys && m_index_out && m_roots_out && m_nodes_in;
+	m_flushed = limit;
+	m_writer = std::make_unique<writer>(*this, limit);
+}
+
+
+std::optional<std::uint64_t> table_store::commit(table const& root)
+{
+	if (!m_open)
+	{
+		return std::nullopt;
+	}
+	auto const offset = m_writer->write(root);
+
+	// Nodes before the dictionary and index that name them, the root last. What
+	// is remembered of written nodes may name records that did not make it to
+	// the files, so after a failure the store takes no more commits.
+	m_nodes.flush();
+	m_flushed = m_writer->end_offset();
+	m_keys.flush();
+	m_index_out.flush();
+	if (m_nodes && m_keys && m_index_out)
+	{
+		binary_format::write_uint(m_roots_out, offset);
+		m_roots_out.flush();
+	}
+	if (!m_nodes || !m_keys || !m_index_out || !m_roots_out)
+	{
+		m_open = false;
+		return std::nullopt;
+	}
+
+	m_roots.push_back(offset);
+	return m_roots.size() - 1;
+}
+
+
+table table_store::load(std::uint64_t version) const
+{
+	if (version >= m_roots.size())
+	{
+		return make_error(lookup_error, "No such version");
+	}
+	auto const image = std::make_shared<binary_image>(path("nodes.bin"), path("keys.idx"));
+	return image->open(m_roots[version]);
+}
+
+
+std::uint64_t table_store::emit(std::string const& record)
+{
+	auto const hash = hash_record(record);
+	auto const range = m_index.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		if (stored_equals(it->second, record))
+		{
+			return it->second;
+		}
+	}
+
+	auto const offset = m_writer->append(record);
+	m_index.emplace(hash, offset);
+	binary_format::write_uint(m_index_out, hash);
+	binary_format::write_uint(m_index_out, offset);
+	return offset;
+}
+
+
+std::uint64_t table_store::key_id(std::string const& key)
+{
+	auto const it = m_key_ids.find(key);
+	if (it != cend(m_key_ids))
+	{
+		return it->second;
+	}
+
+	auto const offset = m_writer->append_key(key);
+	binary_format::write_uint(m_keys, offset);
+	return m_key_ids.emplace(key, m_key_ids.size()).first->second;
+}
+
+
+bool table_store::stored_equals(std::uint64_t offset, std::string const& record)
+{
+	// The record may still be sitting in the stream buffer.
+	if (offset >= m_flushed)
+	{
+		m_nodes.flush();
+		m_flushed = m_writer->end_offset();
+	}
+	m_nodes_in.clear();
+	m_nodes_in.seekg(static_cast<std::streamoff>(offset));
+
+	std::string stored(record.size(), '\0');
+	return m_nodes_in.read(stored.data(), stored.size()) && stored == record;
+}
+
+
+// Returns root with the value stored under the sequence of keys in path. Missing
+// or non-map tables along the way are replaced with maps.
+auto with_path(table const& root, std::vector<table> const& path, std::size_t depth, table const& value) -> table
+{
+	if (depth == path.size())
+	{
+		return value;
+	}
+
+	table const base = root.as_string() ? table() : root;
+	table child = base[path[depth]];
+	if (child.as_string() && depth + 1 < path.size())
+	{
+		child = table();
+	}
+	return base.with(path[depth], with_path(child, path, depth + 1, value));
+}
+
+
+auto with_path(table const& root, std::vector<table> const& path, table const& value) -> table
+{
+	return with_path(root, path, 0, value);
+}
+
+
+// Append-only file with explicit durability.
+class log_file
+{
+public:
+	explicit log_file(std::string const& path)
+		: m_file(std::fopen(path.c_str(), "ab"))
+	{
+	}
+
+	~log_file()
+	{
+		if (m_file)
+		{
+			std::fclose(m_file);
+		}
+	}
+
+	log_file(log_file const&) = delete;
+	log_file& operator= (log_file const&) = delete;
+
+	bool is_open() const
+	{
+		return m_file != nullptr;
+	}
+
+	bool write(std::string const& data)
+	{
+		return std::fwrite(data.data(), 1, data.size(), m_file) == data.size();
+	}
+
+	// Flushes and waits for the data to reach the disk.
+	bool sync()
+	{
+		if (std::fflush(m_file) != 0)
+		{
+			return false;
+		}
+#ifdef _WIN32
+		return _commit(_fileno(m_file)) == 0;
+#else
+		return ::fsync(fileno(m_file)) == 0;
+#endif
+	}
+
+private:
+	std::FILE* m_file;
+};
+
+
+// Waits for a file written and closed elsewhere, or for the entries of a
+// directory, to reach the disk.
+bool sync_path(std::string const& path, bool directory)
+{
+#ifdef _WIN32
+	// NTFS journals renames itself; directories cannot be flushed.
+	if (directory)
+	{
+		return true;
+	}
+	HANDLE const file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	bool const ok = FlushFileBuffers(file) != 0;
+	CloseHandle(file);
+	return ok;
+#else
+	int const fd = ::open(path.c_str(), directory ? (O_RDONLY | O_DIRECTORY) : O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	bool const ok = ::fsync(fd) == 0;
+	::close(fd);
+	return ok;
+#endif
+}
+
+
+// Durable state table built from a stream of updates. Every update is appended to
+// a log before it is acknowledged; concurrent updates are written and synced as
+// one group by whichever caller gets there first. Every checkpoint_interval
+// updates the state is saved as a binary image and a new log segment started:
+//
+//   checkpoint-N.img  state after all records of segments before N
+//   log-N.bin         records since checkpoint N, each u32 size, u32 checksum, then
+//                     varint(path length), path keys and value in inline encoding
+//
+// Recovery maps the newest checkpoint and replays only its segment, so it takes
+// time proportional to the checkpoint interval rather than the history. A torn
+// record at the end of the segment is dropped.
+class table_log
+{
+public:
+	explicit table_log(std::string const& directory, std::size_t checkpoint_interval = 100000);
+
+	bool is_open() const
+	{
+		return m_file && m_file->is_open();
+	}
+
+	table state() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_state;
+	}
+
+	// Number of records replayed when the log was opened.
+	std::size_t recovered() const
+	{
+		return m_recovered;
+	}
+
+	// Applies the update and returns once it is durable.
+	bool update(std::vector<table> const& path, table const& value);
+
+private:
+	std::string path(char const* prefix, std::uint64_t segment, char const* suffix) const
+	{
+		return (m_directory / (prefix + std::to_string(segment) + suffix)).string();
+	}
+
+	void recover();
+	std::size_t replay(std::string const& path);
+	bool checkpoint(table const& snapshot);
+
+	static std::uint32_t checksum(char const* data, std::size_t size)
+	{
+		std::uint32_t h = 0x811c9dc5;
+		for (std::size_t i = 0; i < size; ++i)
+		{
+			h = (h ^ static_cast<std::uint8_t>(data[i])) * 0x01000193;
+		}
+		return h;
+	}
+
+private:
+	std::filesystem::path m_directory;
+	std::size_t m_checkpoint_interval;
+	std::uint64_t m_segment = 0;
+	std::unique_ptr<log_file> m_file;
+	std::size_t m_recovered = 0;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_flushed;
+	table m_state;
+	std::string m_pending;
+	std::uint64_t m_appended = 0;
+	std::uint64_t m_durable = 0;
+	std::size_t m_since_checkpoint = 0;
+	bool m_flushing = false;
+	bool m_failed = false;
+};
+
+
+table_log::table_log(std::string const& directory, std::size_t checkpoint_interval)
+	: m_directory(directory)
+	, m_checkpoint_interval(checkpoint_interval)
+{
+	std::error_code ec;
+	std::filesystem::create_directories(m_directory, ec);
+	recover();
+	m_file = std::make_unique<log_file>(path("log-", m_segment, ".bin"));
+}
+
+
+void table_log::recover()
+{
+	std::vector<std::uint64_t> checkpoints;
+	std::error_code ec;
+	for (auto const& entry : std::filesystem::directory_iterator(m_directory, ec))
+	{
+		// Anything but checkpoint-<digits>.img is not ours and is left alone.
+		auto const name = entry.path().filename().string();
+		if (name.rfind("checkpoint-", 0) == 0 && entry.path().extension() == ".img")
+		{
+			auto const first = name.data() + 11;
+			auto const last = name.data() + name.size() - 4;
+			std::uint64_t segment = 0;
+			auto const parsed = std::from_chars(first, last, segment);
+			if (first != last && parsed.ec == std::errc() && parsed.ptr == last)
+			{
+				checkpoints.push_back(segment);
+			}
+		}
+	}
+	std::sort(begin(checkpoints), end(checkpoints));
+
+	// A checkpoint is only renamed into place once complete, but be defensive.
+	for (auto it = rbegin(checkpoints); it != rend(checkpoints); ++it)
+	{
+		auto const image = load_binary(path("checkpoint-", *it, ".img"));
+		if (image["type"] != "error")
+		{
+			m_state = image;
+			m_segment = *it;
+			break;
+		}
+	}
+	m_recovered = replay(path("log-", m_segment, ".bin"));
+}
+
+
+std::size_t table_log::replay(std::string const& log_path)
+{
+	mapped_file const log(log_path);
+	if (!log.is_open() || log.size() == 0)
+	{
+		return 0;
+	}
+
+	std::size_t count = 0;
+	auto p = log.data();
+	auto const last = log.data() + log.size();
+	while (last - p >= 8)
+	{
+		auto const size = binary_format::load<std::uint32_t>(p);
+		auto const sum = binary_format::load<std::uint32_t>(p + 4);
+		if (static_cast<std::size_t>(last - p - 8) < size || checksum(p + 8, size) != sum)
+		{
+			break;
+		}
+
+		auto q = p + 8;
+		auto const record_end = q + size;
+		std::vector<table> keys(static_cast<std::size_t>(binary_format::load_varint(q, record_end)));
+		bool ok = true;
+		for (auto& key : keys)
+		{
+			auto k = read_inline(q, record_end);
+			ok = ok && k;
+			key = k ? std::move(*k) : table();
+		}
+		auto const value = ok ? read_inline(q, record_end) : std::nullopt;
+		if (!value)
+		{
+			break;
+		}
+
+		m_state = with_path(m_state, keys, *value);
+		++count;
+		p = record_end;
+	}
+
+	// Cut off a torn tail so new records follow the last good one.
+	auto const good = static_cast<std::uintmax_t>(p - log.data());
+	if (good != log.size())
+	{
+		std::error_code ec;
+		std::filesystem::resize_file(log_path, good, ec);
+	}
+	m_since_checkpoint = count;
+	return count;
+}
+
+
+bool table_log::update(std::vector<table> const& keys, table const& value)
+{
+	std::string payload;
+	binary_format::append_varint(payload, keys.size());
+	for (auto const& key : keys)
+	{
+		write_inline(key, payload);
+	}
+	write_inline(value, payload);
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_failed)
+	{
+		return false;
+	}
+
+	binary_format::append_uint(m_pending, payload.size(), 4);
+	binary_format::append_uint(m_pending, checksum(payload.data(), payload.size()), 4);
+	m_pending.append(payload);
+	m_state = with_path(m_state, keys, value);
+	auto const ticket = ++m_appended;
+
+	while (m_durable < ticket && !m_failed)
+	{
+		if (m_flushing)
+		{
+			m_flushed.wait(lock);
+			continue;
+		}
+
+		// Lead a group commit of everything pending, including other callers' records.
+		m_flushing = true;
+		std::string batch;
+		batch.swap(m_pending);
+		auto const upto = m_appended;
+		m_since_checkpoint += static_cast<std::size_t>(upto - m_durable);
+		bool const due = m_since_checkpoint >= m_checkpoint_interval;
+		table const snapshot = due ? m_state : table();
+		lock.unlock();
+
+		bool ok = m_file->write(batch) && m_file->sync();
+		if (ok && due)
+		{
+			ok = checkpoint(snapshot);
+		}
+
+		lock.lock();
+		m_flushing = false;
+		m_failed = !ok;
+		m_durable = upto;
+		if (due && ok)
+		{
+			m_since_checkpoint = 0;
+		}
+		m_flushed.notify_all();
+	}
+	return !m_failed;
+}
+
+
+bool table_log::checkpoint(table const& snapshot)
+{
+	// snapshot covers exactly the records synced to the current segment, later
+	// ones are still pending and go to the next.
+	auto const next = m_segment + 1;
+	auto const image = path("checkpoint-", next, ".img");
+	auto const temp = image + ".tmp";
+	if (!save_binary(snapshot, temp) || !sync_path(temp, false))
+	{
+		return false;
+	}
+
+	// The old checkpoint and segment are the only fallback until the new image
+	// and its name are both on disk.
+	auto file = std::make_unique<log_file>(path("log-", next, ".bin"));
+	std::error_code ec;
+	std::filesystem::rename(temp, image, ec);
+	if (ec || !file->is_open() || !sync_path(m_directory.string(), true))
+	{
+		return false;
+	}
+
+	// Older files are superseded; failing to remove them is harmless.
+	std::filesystem::remove(path("checkpoint-", m_segment, ".img"), ec);
+	std::filesystem::remove(path("log-", m_segment, ".bin"), ec);
+	m_file = std::move(file);
+	m_segment = next;
+	return true;
+}
+
+
+// Tables larger than memory, stored as a B+-tree in a file of fixed-size pages:
+//
+//   header    "RDCTBTR1", u32 page size, u64 root page, u64 entry count
+//   leaf      u8 1, u8 0, u16 count, count * (key cell, value cell)
+//   internal  u8 2, u8 0, u16 count, u64 first child, count * (key cell, u64 child)
+//   cell      0x00 varint(size) inline encoding, or 0x01 u64 offset u64 size of
+//             an overflow blob on pages of its own
+//
+// Pages are never overwritten. with() writes copies of the pages on the path to
+// the changed leaf and returns a table with the new root, so older tables on the
+// same file stay valid. Decoded pages are kept in an LRU cache holding at most
+// cache_bytes worth of pages; everything else stays on disk.
+namespace btree_format
+{
+	constexpr std::size_t page_size = 4096;
+	constexpr std::size_t page_header = 4;
+	constexpr std::size_t max_inline_cell = page_size / 8;
+	constexpr std::uint8_t kind_leaf = 1;
+	constexpr std::uint8_t kind_internal = 2;
+	constexpr std::uint8_t cell_inline = 0;
+	constexpr std::uint8_t cell_overflow = 1;
+	constexpr char magic[8] = { 'R', 'D', 'C', 'T', 'B', 'T', 'R', '1' };
+}
+
+
+struct btree_page
+{
+	bool leaf = true;
+	std::vector<table> keys;
+	std::vector<table> values;            // leaves only
+	std::vector<std::uint64_t> children;  // internal pages only, one more than keys
+	std::vector<std::string> key_cells;   // encoded cells, reused when the page is copied
+	std::vector<std::string> value_cells;
+
+	std::size_t encoded_size() const
+	{
+		std::size_t size = btree_format::page_header + (leaf ? 0 : 8);
+		for (std::size_t i = 0; i < keys.size(); ++i)
+		{
+			size += key_cells[i].size() + (leaf ? value_cells[i].size() : 8);
+		}
+		return size;
+	}
+};
+
+
+class btree_file : public std::enable_shared_from_this<btree_file>
+{
+public:
+	btree_file(std::string const& path, std::size_t cache_bytes, bool create)
+		: m_capacity(std::max<std::size_t>(cache_bytes / btree_format::page_size, 16))
+	{
+		auto const mode = std::ios::binary | std::ios::in | std::ios::out;
+		m_file.open(path, create ? (mode | std::ios::trunc) : mode);
+		if (!m_file)
+		{
+			return;
+		}
+
+		std::string header = read_bytes(0, btree_format::page_size);
+		if (create)
+		{
+			m_pages = 1;
+			m_open = write_header();
+		}
+		else if (header.size() == btree_format::page_size
+			&& std::memcmp(header.data(), btree_format::magic, sizeof(btree_format::magic)) == 0
+			&& binary_format::load<std::uint32_t>(header.data() + 8) == btree_format::page_size)
+		{
+			m_root = binary_format::load<std::uint64_t>(header.data() + 12);
+			m_count = binary_format::load<std::uint64_t>(header.data() + 20);
+			m_file.clear();
+			m_file.seekg(0, std::ios::end);
+			m_pages = static_cast<std::uint64_t>(m_file.tellg()) / btree_format::page_size;
+			m_open = (m_root < m_pages);
+		}
+	}
+
+	bool is_open() const
+	{
+		return m_open;
+	}
+
+	std::uint64_t root() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_root;
+	}
+
+	std::uint64_t count() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_count;
+	}
+
+	// The cached pages, for the first of the views: their cells and slots, while
+	// the keys and values go to tables.
+	void resident(table_source::memory& usage) const
+	{
+		if (!usage.first(this))
+		{
+			return;
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto const inline_capacity = std::string().capacity();
+		usage.backing += sizeof(*this);
+		for (auto const& entry : m_lru)
+		{
+			auto const& page = *entry.second;
+			usage.backing += sizeof(entry) + 2 * sizeof(void*) + sizeof(page)
+				+ (page.keys.capacity() + page.values.capacity()) * sizeof(table)
+				+ page.children.capacity() * sizeof(std::uint64_t)
+				+ (page.key_cells.capacity() + page.value_cells.capacity()) * sizeof(std::string);
+			for (auto const& cells : { &page.key_cells, &page.value_cells })
+			{
+				for (auto const& cell : *cells)
+				{
+					usage.backing += (cell.capacity() > inline_capacity) ? cell.capacity() : 0;
+				}
+			}
+			usage.tables.insert(end(usage.tables), cbegin(page.keys), cend(page.keys));
+			usage.tables.insert(end(usage.tables), cbegin(page.values), cend(page.values));
+		}
+	}
+
+	// Makes root the tree that opening the file returns.
+	bool publish(std::uint64_t root, std::uint64_t count)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_root = root;
+		m_count = count;
+		return write_header();
+	}
+
+	std::shared_ptr<btree_page const> page(std::uint64_t id)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto const it = m_cached.find(id);
+		if (it != cend(m_cached))
+		{
+			m_lru.splice(begin(m_lru), m_lru, it->second);
+			return it->second->second;
+		}
+
+		auto page = decode(read_bytes(id * btree_format::page_size, btree_format::page_size));
+		cache(id, page);
+		return page;
+	}
+
+	std::uint64_t write_page(btree_page const& page)
+	{
+		std::string bytes;
+		bytes.reserve(btree_format::page_size);
+		bytes.push_back(static_cast<char>(page.leaf ? btree_format::kind_leaf : btree_format::kind_internal));
+		bytes.push_back(0);
+		binary_format::append_uint(bytes, page.keys.size(), 2);
+		if (!page.leaf)
+		{
+			binary_format::append_uint(bytes, page.children[0], 8);
+		}
+		for (std::size_t i = 0; i < page.keys.size(); ++i)
+		{
+			bytes.append(page.key_cells[i]);
+			if (page.leaf)
+			{
+				bytes.append(page.value_cells[i]);
+			}
+			else
+			{
+				binary_format::append_uint(bytes, page.children[i + 1], 8);
+			}
+		}
+		assert(bytes.size() <= btree_format::page_size);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto const id = append(bytes);
+		cache(id, std::make_shared<btree_page const>(page));
+		return id;
+	}
+
+	// Encodes a key or value, moving large ones out of line.
+	std::string make_cell(table const& t)
+	{
+		std::string encoded;
+		write_inline(t, encoded);
+
+		std::string cell;
+		if (encoded.size() + 11 <= btree_format::max_inline_cell)
+		{
+			cell.push_back(static_cast<char>(btree_format::cell_inline));
+			binary_format::append_varint(cell, encoded.size());
+			cell.append(encoded);
+			return cell;
+		}
+
+		std::uint64_t offset;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			offset = append(encoded) * btree_format::page_size;
+		}
+		std::uint64_t const size = encoded.size();
+		cell.push_back(static_cast<char>(btree_format::cell_overflow));
+		binary_format::append_uint(cell, offset, 8);
+		binary_format::append_uint(cell, size, 8);
+		return cell;
+	}
+
+private:
+	// The following expect m_mutex to be held (or the file to be private still).
+
+	std::shared_ptr<btree_page const> decode(std::string const& bytes)
+	{
+		auto page = std::make_shared<btree_page>();
+		if (bytes.size() < btree_format::page_header)
+		{
+			return page;
+		}
+
+		page->leaf = (static_cast<std::uint8_t>(bytes[0]) == btree_format::kind_leaf);
+		auto const count = binary_format::load<std::uint16_t>(bytes.data() + 2);
+		auto p = bytes.data() + btree_format::page_header;
+		auto const last = bytes.data() + bytes.size();
+		if (!page->leaf)
+		{
+			page->children.push_back(binary_format::load<std::uint64_t>(p));
+			p += 8;
+		}
+
+		for (std::uint16_t i = 0; i < count && p < last; ++i)
+		{
+			page->keys.push_back(read_cell(p, last, page->key_cells));
+			if (page->leaf)
+			{
+				page->values.push_back(read_cell(p, last, page->value_cells));
+			}
+			else
+			{
+				page->children.push_back(binary_format::load<std::uint64_t>(p));
+				p += 8;
+			}
+		}
+		return page;
+	}
+
+	table read_cell(char const*& p, char const* last, std::vector<std::string>& cells)
+	{
+		auto const first = p;
+		std::optional<table> value;
+		if (static_cast<std::uint8_t>(*p++) == btree_format::cell_inline)
+		{
+			auto const size = binary_format::load_varint(p, last);
+			auto q = p;
+			value = read_inline(q, std::min(last, p + size));
+			p += size;
+		}
+		else
+		{
+			auto const offset = binary_format::load<std::uint64_t>(p);
+			auto const size = binary_format::load<std::uint64_t>(p + 8);
+			p += 16;
+			auto const blob = read_bytes(offset, static_cast<std::size_t>(size));
+			auto q = blob.data();
+			value = read_inline(q, blob.data() + blob.size());
+		}
+		cells.emplace_back(first, p);
+		return value ? std::move(*value) : make_error(format_error, "Corrupt B+-tree cell");
+	}
+
+	void cache(std::uint64_t id, std::shared_ptr<btree_page const> page)
+	{
+		m_lru.emplace_front(id, std::move(page));
+		m_cached[id] = begin(m_lru);
+		while (m_lru.size() > m_capacity)
+		{
+			m_cached.erase(m_lru.back().first);
+			m_lru.pop_back();
+		}
+	}
+
+	// Writes bytes at the end of the file on whole pages, returns the first page.
+	std::uint64_t append(std::string const& bytes)
+	{
+		auto const id = m_pages;
+		auto const pages = std::max<std::uint64_t>(1, (bytes.size() + btree_format::page_size - 1) / btree_format::page_size);
+		std::string padded = bytes;
+		padded.resize(static_cast<std::size_t>(pages * btree_format::page_size), '\0');
+		m_file.clear();
+		m_file.seekp(static_cast<std::streamoff>(id * btree_format::page_size));
+		m_file.write(padded.data(), static_cast<std::streamsize>(padded.size()));
+		m_pages += pages;
+		return id;
+	}
+
+	std::string read_bytes(std::uint64_t offset, std::size_t size)
+	{
+		std::string bytes(size, '\0');
+		m_file.clear();
+		m_file.seekg(static_cast<std::streamoff>(offset));
+		m_file.read(bytes.data(), static_cast<std::streamsize>(size));
+		bytes.resize(static_cast<std::size_t>(m_file.gcount()));
+		return bytes;
+	}
+
+	bool write_header()
+	{
+		std::string header(btree_format::magic, sizeof(btree_format::magic));
+		binary_format::append_uint(header, btree_format::page_size, 4);
+		binary_format::append_uint(header, m_root, 8);
+		binary_format::append_uint(header, m_count, 8);
+		header.resize(btree_format::page_size, '\0');
+		m_file.clear();
+		m_file.seekp(0);
+		m_file.write(header.data(), static_cast<std::streamsize>(header.size()));
+		m_file.flush();
+		return static_cast<bool>(m_file);
+	}
+
+private:
+	mutable std::mutex m_mutex;
+	std::fstream m_file;
+	bool m_open = false;
+	std::uint64_t m_pages = 0;
+	std::uint64_t m_root = 0;
+	std::uint64_t m_count = 0;
+
+	std::size_t m_capacity;
+	std::list<std::pair<std::uint64_t, std::shared_ptr<btree_page const>>> m_lru;
+	std::unordered_map<std::uint64_t, decltype(m_lru)::iterator> m_cached;
+};
+
+
+class btree_view : public table_source
+{
+public:
+	btree_view(std::shared_ptr<btree_file> file, std::uint64_t root, std::uint64_t count)
+		: m_file(std::move(file))
+		, m_root(root)
+		, m_count(count)
+	{
+	}
+
+	bool is_string() const override
+	{
+		return false;
+	}
+
+	std::size_t size() const override
+	{
+		return static_cast<std::size_t>(m_count);
+	}
+
+	table lookup(table const& key) const override
+	{
+		auto page = m_file->page(m_root);
+		while (!page->leaf)
+		{
+			auto const it = std::upper_bound(cbegin(page->keys), cend(page->keys), key);
+			page = m_file->page(page->children[it - cbegin(page->keys)]);
+		}
+
+		auto const it = std::lower_bound(cbegin(page->keys), cend(page->keys), key);
+		if (it == cend(page->keys) || (*it) != key)
+		{
+			return lookup_error;
+		}
+		return page->values[it - cbegin(page->keys)];
+	}
+
+	table::values_type decode() const override
+	{
+		table::values_map values;
+		for_each([&](table const& key, table const& value) { values.emplace_hint(cend(values), key, value); });
+		return values;
+	}
+
+	std::optional<table> with(table const& key, table const& value) const override
+	{
+		auto const result = insert(m_root, key, value);
+		auto root = result.left;
+		if (result.right)
+		{
+			btree_page page;
+			page.leaf = false;
+			page.children = { result.left, *result.right };
+			page.keys = { result.separator };
+			page.key_cells = { result.separator_cell };
+			root = m_file->write_page(page);
+		}
+		return table(std::make_unique<btree_view>(m_file, root, m_count + (result.added ? 1 : 0)));
+	}
+
+	bool for_each(std::function<void(table const&, table const&)> const& f) const override
+	{
+		visit(m_root, f);
+		return true;
+	}
+
+	void resident(memory& usage) const override
+	{
+		usage.bytes = sizeof(*this);
+		m_file->resident(usage);
+	}
+
+	bool publish() const
+	{
+		return m_file->publish(m_root, m_count);
+	}
+
+private:
+	struct insert_result
+	{
+		std::uint64_t left = 0;
+		std::optional<std::uint64_t> right; // set if the page was split
+		table separator;                    // first key of right
+		std::string separator_cell;
+		bool added = false;
+	};
+
+	// The key's cell is only made when it is added: an existing key keeps its
+	// cell, and a new one for a long key would be an overflow blob nothing uses.
+	insert_result insert(std::uint64_t id, table const& key, table const& value) const
+	{
+		btree_page page = *m_file->page(id);
+		insert_result result;
+		if (page.leaf)
+		{
+			auto const i = std::lower_bound(cbegin(page.keys), cend(page.keys), key) - cbegin(page.keys);
+			auto value_cell = m_file->make_cell(value);
+			if (i < static_cast<std::ptrdiff_t>(page.keys.size()) && page.keys[i] == key)
+			{
+				page.values[i] = value;
+				page.value_cells[i] = std::move(value_cell);
+			}
+			else
+			{
+				page.keys.insert(begin(page.keys) + i, key);
+				page.key_cells.insert(begin(page.key_cells) + i, m_file->make_cell(key));
+				page.values.insert(begin(page.values) + i, value);
+				page.value_cells.insert(begin(page.value_cells) + i, std::move(value_cell));
+				result.added = true;
+			}
+		}
+		else
+		{
+			auto const i = std::upper_bound(cbegin(page.keys), cend(page.keys), key) - cbegin(page.keys);
+			auto const child = insert(page.children[i], key, value);
+			page.children[i] = child.left;
+			if (child.right)
+			{
+				page.keys.insert(begin(page.keys) + i, child.separator);
+				page.key_cells.insert(begin(page.key_cells) + i, child.separator_cell);
+				page.children.insert(begin(page.children) + i + 1, *child.right);
+			}
+			result.added = child.added;
+		}
+
+		if (page.encoded_size() <= btree_format::page_size)
+		{
+			result.left = m_file->write_page(page);
+			return result;
+		}
+		split(page, result);
+		return result;
+	}
+
+	// Splits an overfull page at the middle of its encoded size.
+	void split(btree_page& page, insert_result& result) const
+	{
+		auto const total = page.encoded_size();
+		std::size_t at = 0;
+		for (std::size_t bytes = 0; at + 1 < page.keys.size() && bytes < total / 2; ++at)
+		{
+			bytes += page.key_cells[at].size() + (page.leaf ? page.value_cells[at].size() : 8);
+		}
+
+		btree_page right;
+		right.leaf = page.leaf;
+		result.separator = page.keys[at];
+		result.separator_cell = page.key_cells[at];
+		if (page.leaf)
+		{
+			right.keys.assign(begin(page.keys) + at, end(page.keys));
+			right.key_cells.assign(begin(page.key_cells) + at, end(page.key_cells));
+			right.values.assign(begin(page.values) + at, end(page.values));
+			right.value_cells.assign(begin(page.value_cells) + at, end(page.value_cells));
+			page.values.resize(at);
+			page.value_cells.resize(at);
+		}
+		else
+		{
+			// The separator moves up, its right child starts the new page.
+			right.keys.assign(begin(page.keys) + at + 1, end(page.keys));
+			right.key_cells.assign(begin(page.key_cells) + at + 1, end(page.key_cells));
+			right.children.assign(begin(page.children) + at + 1, end(page.children));
+			page.children.resize(at + 1);
+		}
+		page.keys.resize(at);
+		page.key_cells.resize(at);
+
+		result.left = m_file->write_page(page);
+		result.right = m_file->write_page(right);
+	}
+
+	void visit(std::uint64_t id, std::function<void(table const&, table const&)> const& f) const
+	{
+		auto const page = m_file->page(id);
+		if (page->leaf)
+		{
+			for (std::size_t i = 0; i < page->keys.size(); ++i)
+			{
+				f(page->keys[i], page->values[i]);
+			}
+			return;
+		}
+		for (auto child : page->children)
+		{
+			visit(child, f);
+		}
+	}
+
+private:
+	std::shared_ptr<btree_file> m_file;
+	std::uint64_t m_root;
+	std::uint64_t m_count;
+};
+
+
+// Writes contents into a new B+-tree file, packing pages bottom up, and returns a
+// table on it.
+auto create_disk_table(std::string const& path, table const& contents, std::size_t cache_bytes) -> table
+{
+	auto file = std::make_shared<btree_file>(path, cache_bytes, true);
+	if (!file->is_open())
+	{
+		return make_error(io_error, "Cannot create file");
+	}
+
+	// Each level is a list of (first key, page) for the level above.
+	std::vector<std::tuple<table, std::string, std::uint64_t>> level;
+	btree_page page;
+	std::uint64_t count = 0;
+	auto flush_leaf = [&]()
+	{
+		level.emplace_back(page.keys.front(), page.key_cells.front(), file->write_page(page));
+		page = btree_page();
+	};
+
+	contents.for_each([&](table const& key, table const& value)
+	{
+		page.keys.push_back(key);
+		page.key_cells.push_back(file->make_cell(key));
+		page.values.push_back(value);
+		page.value_cells.push_back(file->make_cell(value));
+		if (page.encoded_size() > btree_format::page_size)
+		{
+			auto const last = page.keys.size() - 1;
+			btree_page next;
+			next.keys.push_back(std::move(page.keys[last]));
+			next.key_cells.push_back(std::move(page.key_cells[last]));
+			next.values.push_back(std::move(page.values[last]));
+			next.value_cells.push_back(std::move(page.value_cells[last]));
+			page.keys.pop_back();
+			page.key_cells.pop_back();
+			page.values.pop_back();
+			page.value_cells.pop_back();
+			flush_leaf();
+			page = std::move(next);
+		}
+		++count;
+	});
+	if (level.empty() || !page.keys.empty())
+	{
+		if (page.keys.empty())
+		{
+			level.emplace_back(table(), std::string(), file->write_page(page));
+		}
+		else
+		{
+			flush_leaf();
+		}
+	}
+
+	while (level.size() > 1)
+	{
+		decltype(level) parents;
+		btree_page parent;
+		parent.leaf = false;
+		table first_key;
+		std::string first_cell;
+		for (auto& [key, cell, id] : level)
+		{
+			if (parent.children.empty())
+			{
+				first_key = key;
+				first_cell = cell;
+				parent.children.push_back(id);
+				continue;
+			}
+			if (parent.encoded_size() + cell.size() + 8 > btree_format::page_size)
+			{
+				parents.emplace_back(first_key, first_cell, file->write_page(parent));
+				parent = btree_page();
+				parent.leaf = false;
+				first_key = key;
+				first_cell = cell;
+				parent.children.push_back(id);
+				continue;
+			}
+			parent.keys.push_back(key);
+			parent.key_cells.push_back(cell);
+			parent.children.push_back(id);
+		}
+		parents.emplace_back(first_key, first_cell, file->write_page(parent));
+		level = std::move(parents);
+	}
+
+	file->publish(std::get<2>(level.front()), count);
+	return table(std::make_unique<btree_view>(file, std::get<2>(level.front()), count));
+}
+
+
+auto open_disk_table(std::string const& path, std::size_t cache_bytes) -> table
+{
+	auto file = std::make_shared<btree_file>(path, cache_bytes, false);
+	if (!file->is_open())
+	{
+		return make_error(io_error, "Cannot open B+-tree file");
+	}
+	auto const root = file->root();
+	auto const count = file->count();
+	return table(std::make_unique<btree_view>(std::move(file), root, count));
+}
+
+
+// Makes t, a table on a B+-tree file, the one that opening the file returns.
+bool commit_disk_table(table const& t)
+{
+	auto const view = dynamic_cast<btree_view const*>(t.source());
+	return view && view->publish();
+}
+
+
+// Builds a map from entries added one at a time. Entries that arrive in key order
+// are appended to the map without searching it; otherwise they are sorted first.
+// Of two entries with the same key the later one wins.
+class table_builder
+{
+public:
+	void reserve(std::size_t count)
+	{
+		m_entries.reserve(count);
+	}
+
+	void add(table key, table value)
+	{
+		if (m_sorted && !m_entries.empty() && !(m_entries.back().first < key))
+		{
+			m_sorted = false;
+		}
+		m_entries.emplace_back(std::move(key), std::move(value));
+	}
+
+	table build()
+	{
+		return table(build_values());
+	}
+
+	table::values_map build_values()
+	{
+		if (!m_sorted)
+		{
+			std::stable_sort(begin(m_entries), end(m_entries), [](auto const& a, auto const& b)
+			{
+				return a.first < b.first;
+			});
+		}
+
+		table::values_map values;
+		for (auto& kv : m_entries)
+		{
+			auto const it = values.emplace_hint(values.end(), std::move(kv.first), table());
+			it->second = std::move(kv.second);
+		}
+		m_entries.clear();
+		m_sorted = true;
+		return values;
+	}
+
+private:
+	std::vector<std::pair<table, table>> m_entries;
+	bool m_sorted = true;
+};
+
+
+// JSON maps onto tables as follows: objects become maps with string keys, arrays
+// maps keyed by index ("0", "1", ...), and strings, numbers, true, false and null
+// strings, numbers keeping their text. Writing goes the other way, with maps keyed
+// by exactly the indexes 0 to n-1 written as arrays and every string as a JSON
+// string, so the empty array reads back as {} and numbers come back quoted.
+namespace json
+{
+	inline bool is_space(char c)
+	{
+		return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+	}
+
+	inline char const* skip_space(char const* p, char const* last)
+	{
+		while (p != last && is_space(*p))
+		{
+			++p;
+		}
+		return p;
+	}
+
+	// First '"', '\\' or control character at or after p, or last. Looks at 16
+	// bytes at a time where SSE2 is available, string contents are most of a
+	// typical document.
+	inline char const* scan_string(char const* p, char const* last)
+	{
+#if defined(__SSE2__)
+		auto const quote = _mm_set1_epi8('"');
+		auto const backslash = _mm_set1_epi8('\\');
+		auto const control = _mm_set1_epi8(0x1f);
+		for (; last - p >= 16; p += 16)
+		{
+			auto const chunk = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+			auto const special = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+				_mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+			if (auto const mask = _mm_movemask_epi8(special))
+			{
+				return p + __builtin_ctz(static_cast<unsigned>(mask));
+			}
+		}
+#endif
+		while (p != last && *p != '"' && *p != '\\' && static_cast<unsigned char>(*p) >= 0x20)
+		{
+			++p;
+		}
+		return p;
+	}
+
+	inline bool read_hex4(char const*& p, char const* last, std::uint32_t& code)
+	{
+		if (last - p < 4)
+		{
+			return false;
+		}
+		code = 0;
+		for (int i = 0; i < 4; ++i, ++p)
+		{
+			auto const c = *p;
+			auto const digit = (c >= '0' && c <= '9') ? c - '0'
+				: (c >= 'a' && c <= 'f') ? c - 'a' + 10
+				: (c >= 'A' && c <= 'F') ? c - 'A' + 10
+				: -1;
+			if (digit < 0)
+			{
+				return false;
+			}
+			code = (code << 4) | static_cast<std::uint32_t>(digit);
+		}
+		return true;
+	}
+
+	inline void append_utf8(std::string& out, std::uint32_t code)
+	{
+		if (code < 0x80)
+		{
+			out.push_back(static_cast<char>(code));
+		}
+		else if (code < 0x800)
+		{
+			out.push_back(static_cast<char>(0xc0 | (code >> 6)));
+			out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+		}
+		else if (code < 0x10000)
+		{
+			out.push_back(static_cast<char>(0xe0 | (code >> 12)));
+			out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+			out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+		}
+		else
+		{
+			out.push_back(static_cast<char>(0xf0 | (code >> 18)));
+			out.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3f)));
+			out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+			out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+		}
+	}
+
+	// Reads the string starting at the opening quote p.
+	inline bool read_string(char const*& p, char const* last, std::string& out)
+	{
+		++p;
+		out.clear();
+		while (true)
+		{
+			auto const special = scan_string(p, last);
+			out.append(p, special);
+			p = special;
+			if (p == last || static_cast<unsigned char>(*p) < 0x20)
+			{
+				return false;
+			}
+			if (*p++ == '"')
+			{
+				return true;
+			}
+
+			if (p == last)
+			{
+				return false;
+			}
+			switch (*p++)
+			{
+			case '"': out.push_back('"'); break;
+			case '\\': out.push_back('\\'); break;
+			case '/': out.push_back('/'); break;
+			case 'b': out.push_back('\b'); break;
+			case 'f': out.push_back('\f'); break;
+			case 'n': out.push_back('\n'); break;
+			case 'r': out.push_back('\r'); break;
+			case 't': out.push_back('\t'); break;
+			case 'u':
+			{
+				std::uint32_t code;
+				if (!read_hex4(p, last, code))
+				{
+					return false;
+				}
+				std::uint32_t low;
+				if (code >= 0xd800 && code < 0xdc00 && last - p >= 6 && p[0] == '\\' && p[1] == 'u')
+				{
+					auto q = p + 2;
+					if (read_hex4(q, last, low) && low >= 0xdc00 && low < 0xe000)
+					{
+						code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+						p = q;
+					}
+				}
+				append_utf8(out, code);
+				break;
+			}
+			default:
+				return false;
+			}
+		}
+	}
+
+	// Checks the string starting at the opening quote p and moves past it
+	// without decoding it.
+	inline bool skip_string(char const*& p, char const* last)
+	{
+		++p;
+		while (true)
+		{
+			p = scan_string(p, last);
+			if (p == last || static_cast<unsigned char>(*p) < 0x20)
+			{
+				return false;
+			}
+			if (*p++ == '"')
+			{
+				return true;
+			}
+
+			if (p == last)
+			{
+				return false;
+			}
+			switch (*p++)
+			{
+			case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+				break;
+			case 'u':
+			{
+				std::uint32_t code;
+				if (!read_hex4(p, last, code))
+				{
+					return false;
+				}
+				break;
+			}
+			default:
+				return false;
+			}
+		}
+	}
+
+	inline bool is_digit(char c)
+	{
+		return c >= '0' && c <= '9';
+	}
+
+	inline bool read_number(char const*& p, char const* last)
+	{
+		auto digits = [&]()
+		{
+			auto const first = p;
+			while (p != last && is_digit(*p))
+			{
+				++p;
+			}
+			return p != first;
+		};
+
+		if (p != last && *p == '-')
+		{
+			++p;
+		}
+		if (p != last && *p == '0')
+		{
+			++p;
+		}
+		else if (!digits())
+		{
+			return false;
+		}
+		if (p != last && *p == '.')
+		{
+			++p;
+			if (!digits())
+			{
+				return false;
+			}
+		}
+		if (p != last && (*p == 'e' || *p == 'E'))
+		{
+			++p;
+			if (p != last && (*p == '+' || *p == '-'))
+			{
+				++p;
+			}
+			if (!digits())
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+
+// A JSON document read lazily. read_json checks the text in one pass without
+// building any tables and notes where each object and array ends; the tables it
+// returns are views that decode a container's entries when first used. A view
+// that is decoded whole goes straight from the text into a table_builder, one
+// that is looked up in indexes its entries first.
+struct json_document
+{
+	// A non-empty object or array, in the order they open: the offset just past
+	// its closing bracket and the container that follows it in the text.
+	struct container
+	{
+		std::uint64_t end = 0;
+		std::uint64_t next = 0;
+	};
+
+	std::unique_ptr<mapped_file> file; // holds the text when read from a file,
+	std::string copy;                  // otherwise this does
+	std::string_view text;
+	std::vector<container> containers;
+};
+
+
+class json_view : public table_source
+{
+public:
+	json_view(std::shared_ptr<json_document const> document, std::uint64_t offset, std::uint64_t index)
+		: m_document(std::move(document))
+		, m_offset(offset)
+		, m_index(index)
+	{
+	}
+
+	// The value whose text starts at offset; index is the container it opens if
+	// it is a non-empty object or array.
+	static table value(std::shared_ptr<json_document const> const& document, std::uint64_t offset, std::uint64_t index)
+	{
+		auto const text = document->text;
+		auto p = text.data() + offset;
+		auto const last = text.data() + text.size();
+		switch (*p)
+		{
+		case '{':
+		case '[':
+			if (*json::skip_space(p + 1, last) == (*p == '[' ? ']' : '}'))
+			{
+				return table();
+			}
+			return table(std::make_unique<json_view>(document, offset, index));
+		case '"':
+		{
+			auto const end = json::scan_string(p + 1, last);
+			if (*end == '"')
+			{
+				return std::string(p + 1, end);
+			}
+			std::string str;
+			json::read_string(p, last, str);
+			return str;
+		}
+		case 't':
+			return intern("true");
+		case 'f':
+			return intern("false");
+		case 'n':
+			return intern("null");
+		default:
+		{
+			auto const start = p;
+			json::read_number(p, last);
+			return std::string(start, p);
+		}
+		}
+	}
+
+	bool is_string() const override
+	{
+		return false;
+	}
+
+	std::size_t size() const override
+	{
+		return lookups().entries.size();
+	}
+
+	table lookup(table const& key) const override
+	{
+		auto const skey = key.as_string();
+		if (!skey)
+		{
+			return lookup_error;
+		}
+		auto const& entries = lookups().entries;
+		auto const it = std::lower_bound(cbegin(entries), cend(entries), std::string_view(*skey),
+			[](entry const& e, std::string_view k) { return e.key < k; });
+		if (it == cend(entries) || it->key != *skey)
+		{
+			return lookup_error;
+		}
+		return child(static_cast<std::size_t>(it - cbegin(entries)));
+	}
+
+	table::values_type decode() const override
+	{
+		table::values_map values;
+		auto add = [&](std::vector<entry> const& entries, auto&& value_at)
+		{
+			for (std::size_t i = 0; i < entries.size(); ++i)
+			{
+				values.emplace_hint(cend(values), key(entries, i), value_at(i));
+			}
+		};
+
+		{
+			std::lock_guard<std::mutex> lock(m_index_mutex);
+			if (m_lookups)
+			{
+				auto& children = m_lookups->children;
+				add(m_lookups->entries, [&](std::size_t i)
+				{
+					if (!children[i])
+					{
+						children[i] = value(m_document, m_lookups->entries[i].offset, m_lookups->entries[i].index);
+					}
+					return *children[i];
+				});
+				return values;
+			}
+		}
+
+		// Not looked up in so far, and most likely never will be once decoded.
+		// Decoding does not nest, so one buffer a thread does for the entries.
+		thread_local std::vector<entry> entries;
+		std::list<std::string> keys;
+		sorted_entries(entries, keys);
+		add(entries, [&](std::size_t i) { return value(m_document, entries[i].offset, entries[i].index); });
+		return values;
+	}
+
+	bool for_each(std::function<void(table const&, table const&)> const& f) const override
+	{
+		auto const& entries = lookups().entries;
+		for (std::size_t i = 0; i < entries.size(); ++i)
+		{
+			f(key(entries, i), child(i));
+		}
+		return true;
+	}
+
+	void resident(memory& usage) const override
+	{
+		usage.bytes = sizeof(*this);
+		{
+			std::lock_guard<std::mutex> lock(m_index_mutex);
+			if (m_lookups)
+			{
+				usage.bytes += sizeof(lookup_index) + m_lookups->entries.capacity() * sizeof(entry)
+					+ m_lookups->children.capacity() * sizeof(std::optional<table>);
+				for (auto const& k : m_lookups->keys)
+				{
+					usage.bytes += 2 * sizeof(void*) + sizeof(k) + k.capacity();
+				}
+				for (auto const& child : m_lookups->children)
+				{
+					if (child)
+					{
+						usage.tables.push_back(*child);
+					}
+				}
+			}
+		}
+		auto const& document = *m_document;
+		if (usage.first(&document))
+		{
+			usage.backing += sizeof(document) + document.copy.capacity()
+				+ document.containers.capacity() * sizeof(json_document::container);
+			usage.mapped += document.file ? document.file->resident_bytes() : 0;
+		}
+	}
+
+private:
+	struct entry
+	{
+		std::string_view key;
+		std::uint64_t offset = 0; // of the value
+		std::uint64_t index = 0;  // container the value opens, if any
+	};
+
+	// Entries for lookups and the values decoded from them so far.
+	struct lookup_index
+	{
+		std::vector<entry> entries;
+		std::list<std::string> keys; // keys not in the text as they are
+		std::vector<std::optional<table>> children;
+	};
+
+	// Calls f(key, in_text, offset, index) for each entry in the order of the
+	// text. The document has been checked, so this only has to find them:
+	// nested containers are skipped using their recorded ends. The key is in
+	// the text if in_text is set, otherwise it lasts for the call.
+	template <typename F>
+	void scan(F&& f) const
+	{
+		auto const text = m_document->text;
+		auto const& containers = m_document->containers;
+		auto const first = text.data();
+		auto const last = first + text.size();
+		auto p = first + m_offset;
+		bool const array = (*p++ == '[');
+		auto next = m_index + 1;
+		std::string str;
+		for (std::size_t i = 0; ; ++i)
+		{
+			p = json::skip_space(p, last);
+			if (*p == ']' || *p == '}')
+			{
+				break;
+			}
+
+			std::string_view key;
+			bool in_text = false;
+			if (array)
+			{
+				str = std::to_string(i);
+				key = str;
+			}
+			else
+			{
+				auto const end = json::scan_string(p + 1, last);
+				if (*end == '"')
+				{
+					key = std::string_view(p + 1, static_cast<std::size_t>(end - p - 1));
+					in_text = true;
+					p = end + 1;
+				}
+				else
+				{
+					json::read_string(p, last, str);
+					key = str;
+				}
+				p = json::skip_space(json::skip_space(p, last) + 1, last);
+			}
+
+			auto const offset = static_cast<std::uint64_t>(p - first);
+			std::uint64_t index = 0;
+			if (*p == '{' || *p == '[')
+			{
+				auto const inner = json::skip_space(p + 1, last);
+				if (*inner == (*p == '[' ? ']' : '}'))
+				{
+					p = inner + 1;
+				}
+				else
+				{
+					index = next;
+					p = first + containers[next].end;
+					next = containers[next].next;
+				}
+			}
+			else if (*p == '"')
+			{
+				json::skip_string(p, last);
+			}
+			else if (*p == 't' || *p == 'n')
+			{
+				p += 4;
+			}
+			else if (*p == 'f')
+			{
+				p += 5;
+			}
+			else
+			{
+				json::read_number(p, last);
+			}
+			f(key, in_text, offset, index);
+
+			p = json::skip_space(p, last);
+			if (*p == ',')
+			{
+				++p;
+			}
+		}
+	}
+
+	lookup_index const& lookups() const
+	{
+		std::lock_guard<std::mutex> lock(m_index_mutex);
+		if (!m_lookups)
+		{
+			m_lookups = make_lookups();
+		}
+		return *m_lookups;
+	}
+
+	std::unique_ptr<lookup_index> make_lookups() const
+	{
+		auto lookups = std::make_unique<lookup_index>();
+		sorted_entries(lookups->entries, lookups->keys);
+		lookups->children.resize(lookups->entries.size());
+		return lookups;
+	}
+
+	// The entries in key order with the last of equal keys, as when reading them
+	// into a table. Keys not in the text are kept in keys.
+	void sorted_entries(std::vector<entry>& entries, std::list<std::string>& keys) const
+	{
+		entries.clear();
+		scan([&](std::string_view key, bool in_text, std::uint64_t offset, std::uint64_t index)
+		{
+			if (!in_text)
+			{
+				key = keys.emplace_back(key);
+			}
+			entries.push_back({ key, offset, index });
+		});
+
+		// Keys written from a table are already in order.
+		auto const unordered = [](entry const& a, entry const& b) { return !(a.key < b.key); };
+		if (std::adjacent_find(cbegin(entries), cend(entries), unordered) != cend(entries))
+		{
+			std::stable_sort(begin(entries), end(entries), [](entry const& a, entry const& b) { return a.key < b.key; });
+			auto out = begin(entries);
+			for (auto it = begin(entries); it != end(entries); ++it)
+			{
+				if (std::next(it) == end(entries) || std::next(it)->key != it->key)
+				{
+					*out++ = *it;
+				}
+			}
+			entries.erase(out, end(entries));
+		}
+	}
+
+	// Keys of small containers are mostly field names that repeat from record to
+	// record and are interned; those of large ones are mostly distinct and would
+	// only fill the pool.
+	static table key(std::vector<entry> const& entries, std::size_t i)
+	{
+		constexpr std::size_t interned_keys = 256;
+		std::string key(entries[i].key);
+		return (entries.size() <= interned_keys) ? intern(key) : table(key);
+	}
+
+	// Values are decoded on first lookup and then kept, as for binary images.
+	table child(std::size_t i) const
+	{
+		auto const& lookups = this->lookups();
+		std::lock_guard<std::mutex> lock(m_index_mutex);
+		auto& slot = m_lookups->children[i];
+		if (!slot)
+		{
+			slot = value(m_document, lookups.entries[i].offset, lookups.entries[i].index);
+		}
+		return *slot;
+	}
+
+private:
+	std::shared_ptr<json_document const> m_document;
+	std::uint64_t m_offset = 0;
+	std::uint64_t m_index = 0;
+	mutable std::mutex m_index_mutex;
+	mutable std::unique_ptr<lookup_index> m_lookups; // made on first lookup
+};
+
+
+// Checks the document's text and notes its containers, then returns its value.
+auto read_json(std::shared_ptr<json_document> document) -> table
+{
+	REDUCT_TRACE("read-json");
+	auto& containers = document->containers;
+
+	// Containers being read, innermost last.
+	struct open_container
+	{
+		std::uint64_t index = 0;
+		bool array = false;
+	};
+	std::vector<open_container> stack;
+
+	char const* const first = document->text.data();
+	auto const last = first + document->text.size();
+	auto p = first;
+	auto error = [&](char const* message)
+	{
+		return make_error(read_error, std::string(message) + " at offset " + std::to_string(p - first));
+	};
+
+	auto read_key = [&]()
+	{
+		p = json::skip_space(p, last);
+		if (p == last || *p != '"' || !json::skip_string(p, last))
+		{
+			return false;
+		}
+		p = json::skip_space(p, last);
+		if (p == last || *p != ':')
+		{
+			return false;
+		}
+		++p;
+		return true;
+	};
+	auto literal = [&](char const* word)
+	{
+		auto const size = std::strlen(word);
+		if (static_cast<std::size_t>(last - p) < size || std::memcmp(p, word, size) != 0)
+		{
+			return false;
+		}
+		p += size;
+		return true;
+	};
+
+	auto const root = static_cast<std::uint64_t>(json::skip_space(p, last) - first);
+	while (true)
+	{
+		p = json::skip_space(p, last);
+		if (p == last)
+		{
+			return error("Unexpected end of input");
+		}
+
+		auto const c = *p;
+		if (c == '{' || c == '[')
+		{
+			++p;
+			bool const array = (c == '[');
+			p = json::skip_space(p, last);
+			if (p != last && *p == (array ? ']' : '}'))
+			{
+				++p;
+			}
+			else
+			{
+				stack.push_back({containers.size(), array});
+				containers.emplace_back();
+				if (!array && !read_key())
+				{
+					return error("Expected object key");
+				}
+				continue;
+			}
+		}
+		else if (c == '"')
+		{
+			if (!json::skip_string(p, last))
+			{
+				return error("Bad string");
+			}
+		}
+		else if (c == 't' || c == 'f' || c == 'n')
+		{
+			if (!literal((c == 't') ? "true" : (c == 'f') ? "false" : "null"))
+			{
+				return error("Unexpected character");
+			}
+		}
+		else if (!json::read_number(p, last))
+		{
+			return error("Unexpected character");
+		}
+
+		// Close the containers that the value completes.
+		while (true)
+		{
+			if (stack.empty())
+			{
+				p = json::skip_space(p, last);
+				if (p != last)
+				{
+					return error("Unexpected text after value");
+				}
+				return json_view::value(std::move(document), root, 0);
+			}
+
+			auto const top = stack.back();
+			p = json::skip_space(p, last);
+			if (p != last && *p == ',')
+			{
+				++p;
+				if (!top.array && !read_key())
+				{
+					return error("Expected object key");
+				}
+				break;
+			}
+			if (p == last || *p != (top.array ? ']' : '}'))
+			{
+				return error(top.array ? "Expected ',' or ']'" : "Expected ',' or '}'");
+			}
+			++p;
+			containers[top.index].end = static_cast<std::uint64_t>(p - first);
+			containers[top.index].next = containers.size();
+			stack.pop_back();
+		}
+	}
+}
+
+
+
+auto read_json(std::string_view input) -> table
+{
+	auto document = std::make_shared<json_document>();
+	document->copy.assign(input.data(), input.size());
+	document->text = document->copy;
+	return read_json(std::move(document));
+}
+
+
+// Tables read from the file keep it mapped rather than copied; as with binary
+// images, it must not be truncated while they are in use.
+auto load_json(std::string const& path) -> table
+{
+	auto document = std::make_shared<json_document>();
+	document->file = std::make_unique<mapped_file>(path);
+	if (!document->file->is_open())
+	{
+		return make_error(io_error, "Cannot map file");
+	}
+	document->text = std::string_view(document->file->data(), document->file->size());
+	return read_json(std::move(document));
+}
+
+
+// Streams a table out as JSON, strings are written straight from the tables.
+class json_writer
+{
+public:
+	explicit json_writer(std::ostream& out)
+		: m_out(out)
+	{
+	}
+
+	void write(table const& t)
+	{
+		if (auto pstr = std::get_if<std::string>(&t.values()))
+		{
+			write_string(*pstr);
+			return;
+		}
+
+		std::vector<table> items;
+		if (as_array(t, items))
+		{
+			m_out.put('[');
+			for (std::size_t i = 0; i < items.size(); ++i)
+			{
+				if (i != 0)
+				{
+					m_out.put(',');
+				}
+				write(items[i]);
+			}
+			m_out.put(']');
+			return;
+		}
+
+		m_out.put('{');
+		bool first = true;
+		t.for_each([&](table const& key, table const& value)
+		{
+			if (!first)
+			{
+				m_out.put(',');
+			}
+			first = false;
+
+			if (auto pkey = std::get_if<std::string>(&key.values()))
+			{
+				write_string(*pkey);
+			}
+			else
+			{
+				// JSON keys are strings, a table key is written as its own JSON text.
+				std::ostringstream text;
+				json_writer(text).write(key);
+				write_string(text.str());
+			}
+			m_out.put(':');
+			write(value);
+		});
+		m_out.put('}');
+	}
+
+private:
+	// Collects the values of a map keyed by exactly "0" to "n-1", in index order.
+	static bool as_array(table const& t, std::vector<table>& items)
+	{
+		std::size_t count = 0;
+		t.for_each([&](table const&, table const&) { ++count; });
+		if (count == 0)
+		{
+			return false;
+		}
+
+		items.resize(count);
+		bool array = true;
+		t.for_each([&](table const& key, table const& value)
+		{
+			auto const pkey = std::get_if<std::string>(&key.values());
+			if (!array || !pkey || pkey->empty() || pkey->size() > 19 || ((*pkey)[0] == '0' && pkey->size() > 1)
+				|| !std::all_of(pkey->begin(), pkey->end(), json::is_digit))
+			{
+				array = false;
+				return;
+			}
+			auto const index = std::stoull(*pkey);
+			if (index >= count)
+			{
+				array = false;
+				return;
+			}
+			items[index] = value;
+		});
+		return array;
+	}
+
+	void write_string(std::string const& str)
+	{
+		static char const hex[] = "0123456789abcdef";
+		m_out.put('"');
+		auto p = str.data();
+		auto const last = p + str.size();
+		while (true)
+		{
+			auto const special = json::scan_string(p, last);
+			m_out.write(p, special - p);
+			if (special == last)
+			{
+				break;
+			}
+
+			auto const c = static_cast<unsigned char>(*special);
+			switch (c)
+			{
+			case '"': m_out.write("\\\"", 2); break;
+			case '\\': m_out.write("\\\\", 2); break;
+			case '\b': m_out.write("\\b", 2); break;
+			case '\f': m_out.write("\\f", 2); break;
+			case '\n': m_out.write("\\n", 2); break;
+			case '\r': m_out.write("\\r", 2); break;
+			case '\t': m_out.write("\\t", 2); break;
+			default:
+			{
+				char const escape[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+				m_out.write(escape, sizeof(escape));
+			}
+			}
+			p = special + 1;
+		}
+		m_out.put('"');
+	}
+
+	std::ostream& m_out;
+};
+
+
+void write_json(table const& t, std::ostream& out)
+{
+	REDUCT_TRACE("write-json");
+	json_writer(out).write(t);
+}
+
+
+bool save_json(table const& t, std::string const& path)
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	write_json(t, out);
+	return static_cast<bool>(out.flush());
+}
+
+
+struct csv_options
+{
+	char separator = ','; // '\t' for TSV
+	bool header = true;   // first row names the columns, otherwise they are "0", "1", ...
+	std::string key;      // column to key rows by, otherwise rows are keyed "0", "1", ...
+	unsigned threads = 0; // 0 for one per core
+	std::size_t chunk_min = 1 << 20; // bytes of input for each thread at least
+	bool encode = true;   // dictionary encode fields of columns that repeat values
+};
+
+
+namespace csv
+{
+	// First separator, quote or line break at or after p, or last.
+	inline char const* scan_field(char const* p, char const* last, char separator)
+	{
+#if defined(__SSE2__)
+		auto const sep = _mm_set1_epi8(separator);
+		auto const quote = _mm_set1_epi8('"');
+		auto const lf = _mm_set1_epi8('\n');
+		auto const cr = _mm_set1_epi8('\r');
+		for (; last - p >= 16; p += 16)
+		{
+			auto const chunk = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+			auto const special = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, sep), _mm_cmpeq_epi8(chunk, quote)),
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, lf), _mm_cmpeq_epi8(chunk, cr)));
+			if (auto const mask = _mm_movemask_epi8(special))
+			{
+				return p + __builtin_ctz(static_cast<unsigned>(mask));
+			}
+		}
+#endif
+		while (p != last && *p != separator && *p != '"' && *p != '\n' && *p != '\r')
+		{
+			++p;
+		}
+		return p;
+	}
+
+	// Where a reader is, as far as row ends go. A quote opens a quoted field only
+	// at the start of a field and is kept as text anywhere else, so the number
+	// of quotes before a line break does not tell whether it ends a row.
+	enum class scan_state : std::uint8_t
+	{
+		row,      // at the start of a row
+		field,    // at the start of a later field
+		unquoted, // in a field, or after a quoted part
+		quoted,   // in quotes
+		closed,   // after a quote in quotes: the end of them, or an escaped quote
+		cr,       // after a line break '\r', which a '\n' may complete
+	};
+	constexpr std::size_t scan_states = 6;
+
+	// Follows read_row over one character.
+	inline scan_state step(scan_state state, char c, char separator)
+	{
+		if (state == scan_state::quoted)
+		{
+			return (c == '"') ? scan_state::closed : scan_state::quoted;
+		}
+		if (c == '"')
+		{
+			return (state == scan_state::unquoted) ? scan_state::unquoted : scan_state::quoted;
+		}
+		if (c == separator)
+		{
+			return scan_state::field;
+		}
+		if (c == '\n')
+		{
+			return scan_state::row;
+		}
+		return (c == '\r') ? scan_state::cr : scan_state::unquoted;
+	}
+
+	// The state at last for each state at p, so that chunks can be scanned in
+	// parallel before the state at their starts is known.
+	inline std::array<scan_state, scan_states> scan_chunk(char const* p, char const* last, char separator)
+	{
+		std::array<scan_state, scan_states> states;
+		for (std::size_t i = 0; i < scan_states; ++i)
+		{
+			states[i] = static_cast<scan_state>(i);
+		}
+		while (p != last)
+		{
+			auto const special = scan_field(p, last, separator);
+			if (special != p)
+			{
+				for (auto& state : states)
+				{
+					state = (state == scan_state::quoted) ? scan_state::quoted : scan_state::unquoted;
+				}
+			}
+			if (special == last)
+			{
+				break;
+			}
+			for (auto& state : states)
+			{
+				state = step(state, *special, separator);
+			}
+			p = special + 1;
+		}
+		return states;
+	}
+
+	// First row start at or after p, given the state at p.
+	inline char const* next_row(char const* p, char const* last, char separator, scan_state state)
+	{
+		for (; p != last && state != scan_state::row; ++p)
+		{
+			state = step(state, *p, separator);
+		}
+		return (state == scan_state::row) ? p : last;
+	}
+
+	// Reads one row into fields, p is left at the start of the next. Returns false
+	// on an unterminated quoted field.
+	inline bool read_row(char const*& p, char const* last, char separator, std::vector<std::string>& fields, std::size_t& count)
+	{
+		count = 0;
+		while (true)
+		{
+			if (fields.size() == count)
+			{
+				fields.emplace_back();
+			}
+			auto& field = fields[count++];
+			field.clear();
+
+			if (p != last && *p == '"')
+			{
+				++p;
+				while (true)
+				{
+					auto const quote = static_cast<char const*>(std::memchr(p, '"', last - p));
+					if (!quote)
+					{
+						return false;
+					}
+					field.append(p, quote);
+					p = quote + 1;
+					if (p == last || *p != '"')
+					{
+						break;
+					}
+					field.push_back('"');
+					++p;
+				}
+			}
+
+			// Unquoted, or whatever follows the closing quote.
+			while (true)
+			{
+				auto const special = scan_field(p, last, separator);
+				field.append(p, special);
+				p = special;
+				if (p == last || *p != '"')
+				{
+					break;
+				}
+				field.push_back('"');
+				++p;
+			}
+
+			if (p == last)
+			{
+				return true;
+			}
+			if (*p == separator)
+			{
+				++p;
+				continue;
+			}
+			if (*p == '\r')
+			{
+				++p;
+			}
+			if (p != last && *p == '\n')
+			{
+				++p;
+			}
+			return true;
+		}
+	}
+}
+
+
+// Reads CSV (RFC 4180 quoting, LF or CRLF line ends) into a map of row records,
+// each a map from column name to field. The text is split into one chunk per
+// thread at row boundaries, found by following read_row's quoting through every
+// chunk in parallel from each state it could start in, so that line breaks inside
+// quoted fields are not taken for row ends, and the chunks are parsed in parallel.
+auto read_csv(std::string_view input, csv_options const& options = {}) -> table
+{
+	REDUCT_TRACE("read-csv");
+	auto p = input.data();
+	auto const last = p + input.size();
+
+	std::vector<std::string> fields;
+	std::size_t count = 0;
+	std::vector<table> columns;
+	if (options.header && p != last)
+	{
+		if (!csv::read_row(p, last, options.separator, fields, count))
+		{
+			return make_error(read_error, "Unterminated quoted field in header");
+		}
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			columns.push_back(intern(fields[i]));
+		}
+	}
+
+	std::optional<std::size_t> key_column;
+	if (!options.key.empty())
+	{
+		auto const it = std::find(begin(columns), end(columns), intern(options.key));
+		if (it != end(columns))
+		{
+			key_column = static_cast<std::size_t>(it - begin(columns));
+		}
+		else if (!options.header && std::all_of(begin(options.key), end(options.key), json::is_digit))
+		{
+			key_column = std::stoul(options.key);
+		}
+		else
+		{
+			return make_error(lookup_error, "No column " + options.key);
+		}
+	}
+
+	auto const threads = std::max<std::size_t>(1, std::min<std::size_t>(
+		options.threads ? options.threads : std::thread::hardware_concurrency(),
+		static_cast<std::size_t>(last - p) / std::max<std::size_t>(options.chunk_min, 1) + 1));
+	auto in_parallel = [&](auto&& f)
+	{
+		std::vector<std::thread> workers;
+		for (std::size_t i = 1; i < threads; ++i)
+		{
+			workers.emplace_back(f, i);
+		}
+		f(0);
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+	};
+
+	// Nominal chunk starts, moved forward to the next row start.
+	std::vector<char const*> starts(threads + 1, last);
+	std::vector<std::array<csv::scan_state, csv::scan_states>> chunk_states(threads);
+	for (std::size_t i = 0; i < threads; ++i)
+	{
+		starts[i] = p + (last - p) * i / threads;
+	}
+	in_parallel([&](std::size_t i)
+	{
+		chunk_states[i] = csv::scan_chunk(starts[i], starts[i + 1], options.separator);
+	});
+	auto state = csv::scan_state::row;
+	std::vector<csv::scan_state> start_states(threads, state);
+	for (std::size_t i = 1; i < threads; ++i)
+	{
+		state = chunk_states[i - 1][static_cast<std::size_t>(state)];
+		start_states[i] = state;
+	}
+	for (std::size_t i = 1; i < threads; ++i)
+	{
+		starts[i] = std::max(starts[i - 1], csv::next_row(starts[i], last, options.separator, start_states[i]));
+	}
+
+	// Records of each chunk with their key columns, and the first error in it.
+	std::vector<std::vector<std::pair<table, table>>> rows(threads);
+	std::vector<table> errors(threads);
+	std::vector<std::size_t> order(columns.size());
+	for (std::size_t i = 0; i < order.size(); ++i)
+	{
+		order[i] = i;
+	}
+	std::stable_sort(begin(order), end(order), [&](auto a, auto b) { return columns[a] < columns[b]; });
+
+	in_parallel([&](std::size_t chunk)
+	{
+		std::vector<std::string> fields;
+		std::size_t count = 0;
+		table_builder record;
+		std::vector<string_dictionary> dictionaries(options.encode ? order.size() : 0);
+		auto field = [&](std::size_t i) -> table
+		{
+			return (i < dictionaries.size()) ? dictionaries[i].get(fields[i]) : table(fields[i]);
+		};
+		auto p = starts[chunk];
+		auto const end = starts[chunk + 1];
+		while (p != end)
+		{
+			if (!csv::read_row(p, end, options.separator, fields, count))
+			{
+				errors[chunk] = make_error(read_error, "Unterminated quoted field");
+				return;
+			}
+			if (count == 1 && fields[0].empty())
+			{
+				continue; // blank line
+			}
+
+			table key;
+			if (key_column)
+			{
+				if (*key_column >= count)
+				{
+					errors[chunk] = make_error(lookup_error, "Row without column " + options.key);
+					return;
+				}
+				key = fields[*key_column];
+			}
+
+			for (auto i : order)
+			{
+				if (i < count)
+				{
+					record.add(columns[i], field(i));
+				}
+			}
+			for (auto i = order.size(); i < count; ++i)
+			{
+				record.add(intern(std::to_string(i)), field(i));
+			}
+			rows[chunk].emplace_back(std::move(key), record.build());
+		}
+	});
+
+	for (auto const& error : errors)
+	{
+		if (!error.empty())
+		{
+			return error;
+		}
+	}
+
+	// Number the rows and sort each chunk by key in parallel, then merge the chunks.
+	std::vector<std::size_t> first_row(threads, 0);
+	for (std::size_t i = 1; i < threads; ++i)
+	{
+		first_row[i] = first_row[i - 1] + rows[i - 1].size();
+	}
+	auto const by_key = [](auto const& a, auto const& b) { return a.first < b.first; };
+	in_parallel([&](std::size_t chunk)
+	{
+		if (!key_column)
+		{
+			for (std::size_t i = 0; i < rows[chunk].size(); ++i)
+			{
+				rows[chunk][i].first = std::to_string(first_row[chunk] + i);
+			}
+		}
+		std::stable_sort(begin(rows[chunk]), end(rows[chunk]), by_key);
+	});
+
+	auto& merged = rows[0];
+	for (std::size_t chunk = 1; chunk < threads; ++chunk)
+	{
+		auto const middle = merged.size();
+		merged.insert(end(merged), std::make_move_iterator(begin(rows[chunk])), std::make_move_iterator(end(rows[chunk])));
+		rows[chunk].clear();
+		std::inplace_merge(begin(merged), begin(merged) + middle, end(merged), by_key);
+	}
+
+	table_builder result;
+	result.reserve(merged.size());
+	for (auto& kv : merged)
+	{
+		result.add(std::move(kv.first), std::move(kv.second));
+	}
+	return result.build();
+}
+
+
+auto load_csv(std::string const& path, csv_options const& options = {}) -> table
+{
+	mapped_file const file(path, mapped_file::access::sequential);
+	if (!file.is_open())
+	{
+		return make_error(io_error, "Cannot map file");
+	}
+	return read_csv(std::string_view(file.data(), file.size()), options);
+}
+
+
+// Filter and aggregate kernels over contiguous columns. Filters set one bit per
+// row in a selection bitmap (64 rows to a word, out must hold them all, bits past
+// count are left clear); aggregates visit the rows whose bits are set. Each comes
+// as a plain loop and, on x86 with GCC or Clang, AVX2 and AVX-512 versions; the
+// widest the CPU supports is picked on first use.
+namespace column_kernels
+{
+	inline unsigned lowest_bit(std::uint64_t bits)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanForward64(&index, bits);
+		return static_cast<unsigned>(index);
+#elif defined(_MSC_VER)
+		unsigned long index;
+		if (_BitScanForward(&index, static_cast<unsigned long>(bits)))
+		{
+			return static_cast<unsigned>(index);
+		}
+		_BitScanForward(&index, static_cast<unsigned long>(bits >> 32));
+		return static_cast<unsigned>(index) + 32;
+#else
+		return static_cast<unsigned>(__builtin_ctzll(bits));
+#endif
+	}
+
+	inline std::size_t count_bits(std::uint64_t bits)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		return static_cast<std::size_t>(__popcnt64(bits));
+#elif defined(_MSC_VER)
+		bits -= (bits >> 1) & 0x5555555555555555;
+		bits = (bits & 0x3333333333333333) + ((bits >> 2) & 0x3333333333333333);
+		bits = (bits + (bits >> 4)) & 0x0f0f0f0f0f0f0f0f;
+		return static_cast<std::size_t>((bits * 0x0101010101010101) >> 56);
+#else
+		return static_cast<std::size_t>(__builtin_popcountll(bits));
+#endif
+	}
+
+	struct aggregate_result
+	{
+		double sum = 0;
+		double min = std::numeric_limits<double>::infinity();
+		double max = -std::numeric_limits<double>::infinity();
+	};
+
+	inline void range_scalar(double const* values, std::size_t count, double low, double high, std::uint64_t* out)
+	{
+		for (std::size_t word = 0; word * 64 < count; ++word)
+		{
+			std::uint64_t bits = 0;
+			auto const n = std::min<std::size_t>(64, count - word * 64);
+			for (std::size_t j = 0; j < n; ++j)
+			{
+				auto const v = values[word * 64 + j];
+				bits |= std::uint64_t(v >= low && v <= high) << j;
+			}
+			out[word] = bits;
+		}
+	}
+
+	inline void equal_scalar(std::uint32_t const* codes, std::size_t count, std::uint32_t code, std::uint64_t* out)
+	{
+		for (std::size_t word = 0; word * 64 < count; ++word)
+		{
+			std::uint64_t bits = 0;
+			auto const n = std::min<std::size_t>(64, count - word * 64);
+			for (std::size_t j = 0; j < n; ++j)
+			{
+				bits |= std::uint64_t(codes[word * 64 + j] == code) << j;
+			}
+			out[word] = bits;
+		}
+	}
+
+	inline aggregate_result aggregate_scalar(double const* values, std::uint64_t const* selected, std::size_t count)
+	{
+		aggregate_result result;
+		for (std::size_t word = 0; word * 64 < count; ++word)
+		{
+			for (auto bits = selected[word]; bits != 0; bits &= bits - 1)
+			{
+				auto const v = values[word * 64 + lowest_bit(bits)];
+				result.sum += v;
+				result.min = std::min(result.min, v);
+				result.max = std::max(result.max, v);
+			}
+		}
+		return result;
+	}
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+	__attribute__((target("avx2"))) inline void range_avx2(double const* values, std::size_t count, double low, double high, std::uint64_t* out)
+	{
+		auto const lo = _mm256_set1_pd(low);
+		auto const hi = _mm256_set1_pd(high);
+		std::size_t word = 0;
+		for (; word * 64 + 64 <= count; ++word)
+		{
+			std::uint64_t bits = 0;
+			for (std::size_t j = 0; j < 64; j += 4)
+			{
+				auto const v = _mm256_loadu_pd(values + word * 64 + j);
+				auto const in = _mm256_and_pd(_mm256_cmp_pd(v, lo, _CMP_GE_OQ), _mm256_cmp_pd(v, hi, _CMP_LE_OQ));
+				bits |= std::uint64_t(_mm256_movemask_pd(in)) << j;
+			}
+			out[word] = bits;
+		}
+		if (word * 64 < count)
+		{
+			range_scalar(values + word * 64, count - word * 64, low, high, out + word);
+		}
+	}
+
+	__attribute__((target("avx2"))) inline void equal_avx2(std::uint32_t const* codes, std::size_t count, std::uint32_t code, std::uint64_t* out)
+	{
+		auto const needle = _mm256_set1_epi32(static_cast<int>(code));
+		std::size_t word = 0;
+		for (; word * 64 + 64 <= count; ++word)
+		{
+			std::uint64_t bits = 0;
+			for (std::size_t j = 0; j < 64; j += 8)
+			{
+				auto const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(codes + word * 64 + j));
+				auto const eq = _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, needle));
+				bits |= std::uint64_t(static_cast<unsigned>(_mm256_movemask_ps(eq))) << j;
+			}
+			out[word] = bits;
+		}
+		if (word * 64 < count)
+		{
+			equal_scalar(codes + word * 64, count - word * 64, code, out + word);
+		}
+	}
+
+	__attribute__((target("avx2"))) inline aggregate_result aggregate_avx2(double const* values, std::uint64_t const* selected, std::size_t count)
+	{
+		auto const lanes = _mm256_set_epi64x(8, 4, 2, 1);
+		auto sum = _mm256_setzero_pd();
+		auto min = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+		auto max = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+		std::size_t word = 0;
+		for (; word * 64 + 64 <= count; ++word)
+		{
+			auto const bits = selected[word];
+			for (std::size_t j = 0; j < 64 && (bits >> j) != 0; j += 4)
+			{
+				auto const nibble = static_cast<long long>((bits >> j) & 0xf);
+				if (nibble == 0)
+				{
+					continue;
+				}
+				auto const mask = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(nibble), lanes), lanes));
+				auto const v = _mm256_loadu_pd(values + word * 64 + j);
+				sum = _mm256_add_pd(sum, _mm256_and_pd(v, mask));
+				min = _mm256_blendv_pd(min, _mm256_min_pd(min, v), mask);
+				max = _mm256_blendv_pd(max, _mm256_max_pd(max, v), mask);
+			}
+		}
+
+		aggregate_result result;
+		if (word * 64 < count)
+		{
+			result = aggregate_scalar(values + word * 64, selected + word, count - word * 64);
+		}
+		alignas(32) double s[4], lo[4], hi[4];
+		_mm256_store_pd(s, sum);
+		_mm256_store_pd(lo, min);
+		_mm256_store_pd(hi, max);
+		for (int i = 0; i < 4; ++i)
+		{
+			result.sum += s[i];
+			result.min = std::min(result.min, lo[i]);
+			result.max = std::max(result.max, hi[i]);
+		}
+		return result;
+	}
+
+	__attribute__((target("avx512f"))) inline void range_avx512(double const* values, std::size_t count, double low, double high, std::uint64_t* out)
+	{
+		auto const lo = _mm512_set1_pd(low);
+		auto const hi = _mm512_set1_pd(high);
+		std::size_t word = 0;
+		for (; word * 64 + 64 <= count; ++word)
+		{
+			std::uint64_t bits = 0;
+			for (std::size_t j = 0; j < 64; j += 8)
+			{
+				auto const v = _mm512_loadu_pd(values + word * 64 + j);
+				auto const in = _mm512_mask_cmp_pd_mask(_mm512_cmp_pd_mask(v, lo, _CMP_GE_OQ), v, hi, _CMP_LE_OQ);
+				bits |= std::uint64_t(in) << j;
+			}
+			out[word] = bits;
+		}
+		if (word * 64 < count)
+		{
+			range_scalar(values + word * 64, count - word * 64, low, high, out + word);
+		}
+	}
+
+	__attribute__((target("avx512f"))) inline void equal_avx512(std::uint32_t const* codes, std::size_t count, std::uint32_t code, std::uint64_t* out)
+	{
+		auto const needle = _mm512_set1_epi32(static_cast<int>(code));
+		std::size_t word = 0;
+		for (; word * 64 + 64 <= count; ++word)
+		{
+			std::uint64_t bits = 0;
+			for (std::size_t j = 0; j < 64; j += 16)
+			{
+				auto const v = _mm512_loadu_si512(codes + word * 64 + j);
+				bits |= std::uint64_t(_mm512_cmpeq_epi32_mask(v, needle)) << j;
+			}
+			out[word] = bits;
+		}
+		if (word * 64 < count)
+		{
+			equal_scalar(codes + word * 64, count - word * 64, code, out + word);
+		}
+	}
+
+	__attribute__((target("avx512f"))) inline aggregate_result aggregate_avx512(double const* values, std::uint64_t const* selected, std::size_t count)
+	{
+		auto sum = _mm512_setzero_pd();
+		auto min = _mm512_set1_pd(std::numeric_limits<double>::infinity());
+		auto max = _mm512_set1_pd(-std::numeric_limits<double>::infinity());
+		std::size_t word = 0;
+		for (; word * 64 + 64 <= count; ++word)
+		{
+			auto const bits = selected[word];
+			for (std::size_t j = 0; j < 64 && (bits >> j) != 0; j += 8)
+			{
+				auto const mask = static_cast<__mmask8>(bits >> j);
+				if (mask == 0)
+				{
+					continue;
+				}
+				auto const v = _mm512_maskz_loadu_pd(mask, values + word * 64 + j);
+				sum = _mm512_mask_add_pd(sum, mask, sum, v);
+				min = _mm512_mask_min_pd(min, mask, min, v);
+				max = _mm512_mask_max_pd(max, mask, max, v);
+			}
+		}
+
+		aggregate_result result;
+		if (word * 64 < count)
+		{
+			result = aggregate_scalar(values + word * 64, selected + word, count - word * 64);
+		}
+		alignas(64) double s[8], lo[8], hi[8];
+		_mm512_store_pd(s, sum);
+		_mm512_store_pd(lo, min);
+		_mm512_store_pd(hi, max);
+		for (int i = 0; i < 8; ++i)
+		{
+			result.sum += s[i];
+			result.min = std::min(result.min, lo[i]);
+			result.max = std::max(result.max, hi[i]);
+		}
+		return result;
+	}
+#endif
+
+	struct kernel_set
+	{
+		char const* name;
+		void (*range)(double const* values, std::size_t count, double low, double high, std::uint64_t* out);
+		void (*equal)(std::uint32_t const* codes, std::size_t count, std::uint32_t code, std::uint64_t* out);
+		aggregate_result (*aggregate)(double const* values, std::uint64_t const* selected, std::size_t count);
+	};
+
+	// Every set this processor can run, the scalar one first and the best last.
+	inline std::vector<kernel_set> const& available()
+	{
+		static std::vector<kernel_set> const sets = []()
+		{
+			std::vector<kernel_set> result{ { "scalar", range_scalar, equal_scalar, aggregate_scalar } };
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2"))
+			{
+				result.push_back({ "avx2", range_avx2, equal_avx2, aggregate_avx2 });
+			}
+			if (__builtin_cpu_supports("avx512f"))
+			{
+				result.push_back({ "avx512", range_avx512, equal_avx512, aggregate_avx512 });
+			}
+#endif
+			return result;
+		}();
+		return sets;
+	}
+
+	inline kernel_set const& kernels()
+	{
+		static kernel_set const& selected = available().back();
+		return selected;
+	}
+}
+
+
+// Parses a whole string as a number, as std::from_chars does: no leading space
+// or sign other than '-'. Visual Studio's floating-point <charconv> needs 2019
+// 16.4 or later, older toolsets go through strtod.
+bool parse_double(std::string_view text, double& number)
+{
+#if defined(_MSC_VER) && _MSC_VER < 1924
+	if (text.empty() || std::isspace(static_cast<unsigned char>(text[0])) || text[0] == '+')
+	{
+		return false;
+	}
+	std::string const copy(text);
+	char* end = nullptr;
+	errno = 0;
+	number = std::strtod(copy.c_str(), &end);
+	return errno != ERANGE && end == copy.c_str() + copy.size();
+#else
+	auto const last = text.data() + text.size();
+	auto const parsed = std::from_chars(text.data(), last, number);
+	return parsed.ec == std::errc() && parsed.ptr == last;
+#endif
+}
+
+
+// Records that mostly share their keys, stored by column: the row keys in order,
+// and per column a presence bitmap and the string values of all rows back to back
+// in one buffer. Values that are not strings are kept as tables on the side.
+// Column stores are immutable once built and shared by the views on them.
+//
+// Columns of strings with few distinct values keep a dictionary and a code per
+// row instead of the bytes, and columns that only hold numbers also keep them as
+// doubles (NaN where absent), for the kernels to scan.
+class column_store
+{
+public:
+	static constexpr std::uint32_t no_code = UINT32_MAX;
+
+	struct column
+	{
+		table name;
+		std::vector<std::uint64_t> present;  // bit per row
+		std::vector<std::uint64_t> offsets;  // row i is bytes[offsets[i], offsets[i + 1])
+		std::string bytes;
+		std::vector<std::uint64_t> nested;   // bit per row whose value is in tables
+		std::vector<table> tables;           // by row, empty unless some value is a map
+		std::vector<std::uint32_t> codes;    // by row, into dictionary, instead of bytes
+		std::vector<table> dictionary;       // interned strings
+		std::vector<double> numbers;         // by row, if every value is a number
+
+		bool has(std::size_t row) const
+		{
+			return (present[row / 64] >> (row % 64)) & 1;
+		}
+
+		bool is_nested(std::size_t row) const
+		{
+			return !nested.empty() && ((nested[row / 64] >> (row % 64)) & 1);
+		}
+
+		std::string_view string(std::size_t row) const
+		{
+			if (!codes.empty())
+			{
+				return std::get<std::string>(dictionary[codes[row]].values());
+			}
+			return std::string_view(bytes.data() + offsets[row], offsets[row + 1] - offsets[row]);
+		}
+
+		void encode(std::size_t row_count)
+		{
+			if (!nested.empty())
+			{
+				return;
+			}
+
+			numbers.assign(row_count, std::numeric_limits<double>::quiet_NaN());
+			std::size_t present_count = 0;
+			for (std::size_t row = 0; row < row_count; ++row)
+			{
+				if (!has(row))
+				{
+					continue;
+				}
+				++present_count;
+				double number;
+				if (numbers.empty() || !parse_double(string(row), number) || number != number)
+				{
+					numbers.clear();
+					continue;
+				}
+				numbers[row] = number;
+			}
+			numbers.shrink_to_fit();
+
+			std::unordered_map<std::string_view, std::uint32_t> ids;
+			auto const limit = std::max<std::size_t>(256, present_count / 4);
+			std::vector<std::uint32_t> row_codes(row_count, no_code);
+			for (std::size_t row = 0; row < row_count; ++row)
+			{
+				if (has(row))
+				{
+					auto const id = ids.emplace(string(row), static_cast<std::uint32_t>(ids.size())).first->second;
+					if (ids.size() > limit)
+					{
+						return;
+					}
+					row_codes[row] = id;
+				}
+			}
+
+			dictionary.resize(ids.size());
+			for (auto const& kv : ids)
+			{
+				dictionary[kv.second] = intern(std::string(kv.first));
+			}
+			codes = std::move(row_codes);
+			bytes = std::string();
+			offsets = std::vector<std::uint64_t>();
+		}
+
+		table value(std::size_t row) const
+		{
+			if (is_nested(row))
+			{
+				return tables[row];
+			}
+			if (!codes.empty())
+			{
+				return dictionary[codes[row]];
+			}
+			return std::string(string(row));
+		}
+	};
+
+	// Null if some record is a string rather than a map.
+	static std::shared_ptr<column_store const> build(table const& records)
+	{
+		auto store = std::make_shared<column_store>();
+		std::map<table, std::size_t> names;
+		bool records_only = true;
+		records.for_each([&](table const& key, table const& record)
+		{
+			if (record.as_string())
+			{
+				records_only = false;
+				return;
+			}
+			store->rows.push_back(key);
+			record.for_each([&](table const& name, table const&)
+			{
+				names.emplace(name, 0);
+			});
+		});
+		if (!records_only)
+		{
+			return nullptr;
+		}
+
+		auto const row_count = store->rows.size();
+		for (auto& kv : names)
+		{
+			kv.second = store->columns.size();
+			store->columns.emplace_back();
+			auto& col = store->columns.back();
+			col.name = kv.first;
+			col.present.assign((row_count + 63) / 64, 0);
+			col.offsets.reserve(row_count + 1);
+			col.offsets.push_back(0);
+		}
+
+		std::size_t row = 0;
+		records.for_each([&](table const&, table const& record)
+		{
+			record.for_each([&](table const& name, table const& value)
+			{
+				auto& col = store->columns[names.find(name)->second];
+				col.present[row / 64] |= std::uint64_t(1) << (row % 64);
+				if (auto pstr = std::get_if<std::string>(&value.values()))
+				{
+					col.bytes.append(*pstr);
+				}
+				else
+				{
+					if (col.nested.empty())
+					{
+						col.nested.assign(col.present.size(), 0);
+						col.tables.resize(row_count);
+					}
+					col.nested[row / 64] |= std::uint64_t(1) << (row % 64);
+					col.tables[row] = value;
+				}
+			});
+			++row;
+			for (auto& col : store->columns)
+			{
+				col.offsets.push_back(col.bytes.size());
+			}
+		});
+
+		for (auto& col : store->columns)
+		{
+			col.encode(row_count);
+		}
+		return store;
+	}
+
+	std::size_t row_count() const
+	{
+		return rows.size();
+	}
+
+	std::optional<std::size_t> find_row(table const& key) const
+	{
+		return find(rows, key, [](table const& row) -> table const& { return row; });
+	}
+
+	std::optional<std::size_t> find_column(table const& name) const
+	{
+		return find(columns, name, [](column const& col) -> table const& { return col.name; });
+	}
+
+	// The columns, for the first of the views, while the row keys, names and
+	// values kept as tables go to tables.
+	void resident(table_source::memory& usage) const
+	{
+		if (!usage.first(this))
+		{
+			return;
+		}
+		usage.backing += sizeof(*this) + rows.capacity() * sizeof(table) + columns.capacity() * sizeof(column);
+		usage.tables.insert(end(usage.tables), cbegin(rows), cend(rows));
+		for (auto const& col : columns)
+		{
+			usage.backing += (col.present.capacity() + col.offsets.capacity() + col.nested.capacity()) * sizeof(std::uint64_t)
+				+ col.bytes.capacity() + col.codes.capacity() * sizeof(std::uint32_t)
+				+ (col.tables.capacity() + col.dictionary.capacity()) * sizeof(table)
+				+ col.numbers.capacity() * sizeof(double);
+			usage.tables.push_back(col.name);
+			usage.tables.insert(end(usage.tables), cbegin(col.dictionary), cend(col.dictionary));
+			for (auto const& t : col.tables)
+			{
+				if (!t.empty())
+				{
+					usage.tables.push_back(t);
+				}
+			}
+		}
+	}
+
+	std::vector<table> rows;
+	std::vector<column> columns;
+
+private:
+	template <typename Items, typename Key>
+	static std::optional<std::size_t> find(Items const& items, table const& key, Key key_of)
+	{
+		auto const it = std::lower_bound(begin(items), end(items), key, [&](auto const& item, table const& k)
+		{
+			return key_of(item) < k;
+		});
+		if (it == end(items) || key_of(*it) != key)
+		{
+			return std::nullopt;
+		}
+		return static_cast<std::size_t>(it - begin(items));
+	}
+};
+
+
+// One record of a column store, read straight from the columns.
+class column_row_view : public table_source
+{
+public:
+	column_row_view(std::shared_ptr<column_store const> store, std::size_t row)
+		: m_store(std::move(store))
+		, m_row(row)
+	{
+	}
+
+	bool is_string() const override
+	{
+		return false;
+	}
+
+	std::size_t size() const override
+	{
+		return static_cast<std::size_t>(std::count_if(begin(m_store->columns), end(m_store->columns), [&](auto const& col)
+		{
+			return col.has(m_row);
+		}));
+	}
+
+	table lookup(table const& key) const override
+	{
+		auto const col = m_store->find_column(key);
+		if (!col || !m_store->columns[*col].has(m_row))
+		{
+			return lookup_error;
+		}
+		return m_store->columns[*col].value(m_row);
+	}
+
+	table::values_type decode() const override
+	{
+		table::values_map values;
+		for_each([&](table const& key, table const& value)
+		{
+			values.emplace_hint(values.end(), key, value);
+		});
+		return values;
+	}
+
+	bool for_each(std::function<void(table const&, table const&)> const& f) const override
+	{
+		for (auto const& col : m_store->columns)
+		{
+			if (col.has(m_row))
+			{
+				f(col.name, col.value(m_row));
+			}
+		}
+		return true;
+	}
+
+	void resident(memory& usage) const override
+	{
+		usage.bytes = sizeof(*this);
+		m_store->resident(usage);
+	}
+
+private:
+	std::shared_ptr<column_store const> m_store;
+	std::size_t m_row;
+};
+
+
+// A column store as a map of records, or a selection of its rows (in row order).
+class columnar_view : public table_source
+{
+public:
+	using selection = std::shared_ptr<std::vector<std::size_t> const>;
+
+	explicit columnar_view(std::shared_ptr<column_store const> store, selection rows = nullptr)
+		: m_store(std::move(store))
+		, m_selection(std::move(rows))
+	{
+	}
+
+	column_store const& store() const
+	{
+		return *m_store;
+	}
+
+	std::shared_ptr<column_store const> const& shared_store() const
+	{
+		return m_store;
+	}
+
+	std::size_t row_count() const
+	{
+		return m_selection ? m_selection->size() : m_store->row_count();
+	}
+
+	// Index into the store of the i-th row of this view.
+	std::size_t row(std::size_t i) const
+	{
+		return m_selection ? (*m_selection)[i] : i;
+	}
+
+	bool is_string() const override
+	{
+		return false;
+	}
+
+	std::size_t size() const override
+	{
+		return row_count();
+	}
+
+	table lookup(table const& key) const override
+	{
+		auto const row = m_store->find_row(key);
+		if (!row || (m_selection && !std::binary_search(begin(*m_selection), end(*m_selection), *row)))
+		{
+			return lookup_error;
+		}
+		return record(*row);
+	}
+
+	table::values_type decode() const override
+	{
+		table::values_map values;
+		for_each([&](table const& key, table const& value)
+		{
+			values.emplace_hint(values.end(), key, value);
+		});
+		return values;
+	}
+
+	bool for_each(std::function<void(table const&, table const&)> const& f) const override
+	{
+		for (std::size_t i = 0; i < row_count(); ++i)
+		{
+			f(m_store->rows[row(i)], record(row(i)));
+		}
+		return true;
+	}
+
+	void resident(memory& usage) const override
+	{
+		usage.bytes = sizeof(*this);
+		if (m_selection && usage.first(m_selection.get()))
+		{
+			usage.backing += sizeof(*m_selection) + m_selection->capacity() * sizeof(std::size_t);
+		}
+		m_store->resident(usage);
+	}
+
+private:
+	table record(std::size_t row) const
+	{
+		return table(std::make_unique<column_row_view>(m_store, row));
+	}
+
+	std::shared_ptr<column_store const> m_store;
+	selection m_selection;
+};
+
+
+// Stores a map of records by column. Records read back as views on the columns.
+auto make_columnar(table const& records) -> table
+{
+	REDUCT_TRACE("make-columnar");
+	if (dynamic_cast<columnar_view const*>(records.source()))
+	{
+		return records;
+	}
+	auto store = column_store::build(records);
+	if (!store)
+	{
+		return make_error(format_error, "Not a map of records");
+	}
+	return table(std::make_unique<columnar_view>(std::move(store)));
+}
+
+
+// Selection bitmap of the rows of a columnar view.
+std::vector<std::uint64_t> selection_bits(columnar_view const& view)
+{
+	auto const row_count = view.store().row_count();
+	std::vector<std::uint64_t> bits((row_count + 63) / 64, 0);
+	for (std::size_t i = 0; i < view.row_count(); ++i)
+	{
+		auto const row = view.row(i);
+		bits[row / 64] |= std::uint64_t(1) << (row % 64);
+	}
+	return bits;
+}
+
+
+auto select_rows(columnar_view const& view, std::vector<std::uint64_t> const& bits) -> table
+{
+	REDUCT_TRACE("select-rows");
+	auto rows = std::make_shared<std::vector<std::size_t>>();
+	for (std::size_t word = 0; word < bits.size(); ++word)
+	{
+		for (auto b = bits[word]; b != 0; b &= b - 1)
+		{
+			rows->push_back(word * 64 + column_kernels::lowest_bit(b));
+		}
+	}
+	return table(std::make_unique<columnar_view>(view.shared_store(), std::move(rows)));
+}
+
+
+// Rows of a columnar table whose column holds exactly value, as a columnar table
+// on the same store. Dictionary columns compare codes; others are scanned front
+// to back, comparing lengths from the offsets before any bytes.
+auto select_equal(table const& records, table const& column, std::string const& value) -> table
+{
+	auto const view = dynamic_cast<columnar_view const*>(records.source());
+	if (!view)
+	{
+		return make_error(format_error, "Not a columnar table");
+	}
+
+	auto bits = selection_bits(*view);
+	auto const index = view->store().find_column(column);
+	if (!index)
+	{
+		return select_rows(*view, std::vector<std::uint64_t>());
+	}
+
+	auto const& col = view->store().columns[*index];
+	auto const row_count = view->store().row_count();
+	if (!col.codes.empty())
+	{
+		auto const it = std::find_if(begin(col.dictionary), end(col.dictionary), [&](table const& entry)
+		{
+			return entry.as_string() == value;
+		});
+		std::vector<std::uint64_t> matches(bits.size(), 0);
+		if (it != end(col.dictionary))
+		{
+			column_kernels::kernels().equal(col.codes.data(), row_count, static_cast<std::uint32_t>(it - begin(col.dictionary)), matches.data());
+		}
+		for (std::size_t word = 0; word < bits.size(); ++word)
+		{
+			bits[word] &= matches[word];
+		}
+		return select_rows(*view, bits);
+	}
+
+	auto const size = value.size();
+	for (std::size_t word = 0; word < bits.size(); ++word)
+	{
+		for (auto b = bits[word] & col.present[word]; b != 0; b &= b - 1)
+		{
+			auto const row = word * 64 + column_kernels::lowest_bit(b);
+			if (col.offsets[row + 1] - col.offsets[row] != size || col.is_nested(row)
+				|| std::memcmp(col.bytes.data() + col.offsets[row], value.data(), size) != 0)
+			{
+				bits[word] &= ~(std::uint64_t(1) << (row % 64));
+			}
+		}
+		bits[word] &= col.present[word];
+	}
+	return select_rows(*view, bits);
+}
+
+
+// Rows of a columnar table whose numeric column is within [low, high].
+auto select_range(table const& records, table const& column, double low, double high) -> table
+{
+	auto const view = dynamic_cast<columnar_view const*>(records.source());
+	if (!view)
+	{
+		return make_error(format_error, "Not a columnar table");
+	}
+
+	auto const index = view->store().find_column(column);
+	if (!index)
+	{
+		return select_rows(*view, std::vector<std::uint64_t>());
+	}
+	auto const& col = view->store().columns[*index];
+	if (col.numbers.empty())
+	{
+		return make_error(format_error, "Column is not numeric");
+	}
+
+	auto bits = selection_bits(*view);
+	std::vector<std::uint64_t> matches(bits.size(), 0);
+	column_kernels::kernels().range(col.numbers.data(), col.numbers.size(), low, high, matches.data());
+	for (std::size_t word = 0; word < bits.size(); ++word)
+	{
+		bits[word] &= matches[word];
+	}
+	return select_rows(*view, bits);
+}
+
+
+std::string format_number(double value)
+{
+	// Whole numbers print in full rather than in exponent form.
+	if (value == std::floor(value) && std::fabs(value) < 9007199254740992.0)
+	{
+		return std::to_string(static_cast<long long>(value));
+	}
+	char buffer[32];
+#if defined(_MSC_VER) && _MSC_VER < 1924
+	// Not the shortest form, but it reads back to the same value.
+	auto const length = std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+	return std::string(buffer, static_cast<std::size_t>(length));
+#else
+	auto const result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+	return std::string(buffer, result.ptr);
+#endif
+}
+
+
+// Count of the rows of a columnar table that have the column, and for numeric
+// columns their sum, min and max.
+auto aggregate(table const& records, table const& column) -> table
+{
+	REDUCT_TRACE("aggregate");
+	auto const view = dynamic_cast<columnar_view const*>(records.source());
+	if (!view)
+	{
+		return make_error(format_error, "Not a columnar table");
+	}
+
+	auto const index = view->store().find_column(column);
+	if (!index)
+	{
+		return table({ {"count", "0"} });
+	}
+	auto const& col = view->store().columns[*index];
+	auto bits = selection_bits(*view);
+	std::size_t count = 0;
+	for (std::size_t word = 0; word < bits.size(); ++word)
+	{
+		bits[word] &= col.present[word];
+		count += column_kernels::count_bits(bits[word]);
+	}
+	if (col.numbers.empty() || count == 0)
+	{
+		return table({ {"count", std::to_string(count)} });
+	}
+
+	auto const result = column_kernels::kernels().aggregate(col.numbers.data(), bits.data(), col.numbers.size());
+	return table({
+		{"count", std::to_string(count)},
+		{"sum", format_number(result.sum)},
+		{"min", format_number(result.min)},
+		{"max", format_number(result.max)}
+	});
+}
+
+
+#ifdef REDUCT_INSTRUMENTATION
+auto counters_table(op_counters const& counters) -> table
+{
+	table::values_map values;
+	for (std::size_t i = 0; i < op_counter_count; ++i)
+	{
+		values.emplace(op_counter_names[i], std::to_string(counters[i]));
+	}
+	return values;
+}
+#endif
+
+
+// Symbols evaluate to their entry in the environment, or to themselves if they
+// have none; (map key) evaluates both and looks the key up in the map. A lookup
+// whose map evaluates to itself is left as read, so input that uses nothing
+// from the environment prints just as the reader produced it. Anything else,
+// errors included, evaluates to itself.
+auto evaluate(table const& expr, table const& env) -> table
+{
+	if (expr.is_string())
+	{
+		auto const value = env[expr];
+		if (value == lookup_error)
+		{
+#ifdef REDUCT_INSTRUMENTATION
+			// Unless the environment has its own, stats is bound to the
+			// operation counters of all threads.
+			static table const stats = intern("stats");
+			if (expr == stats)
+			{
+				return counters_table(all_counters());
+			}
+#endif
+			return expr;
+		}
+		return value;
+	}
+
+	if (expr["type"] == "lookup-expression")
+	{
+		auto const unevaluated = expr["map"];
+		auto const map = evaluate(unevaluated, env);
+		if (map == unevaluated)
+		{
+			return expr;
+		}
+		auto const key = expr["key"];
+		return (key == lookup_error) ? map : map[evaluate(key, env)];
+	}
+	return expr;
+}
+
+
+// Session images are binary images of { env = <environment>, version = 1 }. The
+// environment is mapped rather than read back, every reference in it is an offset
+// within the file, so resuming costs the same for any size of environment and the
+// parts that are used are paged in on demand. Strings that repeat are dictionary
+// encoded first; the writer puts a node out once however often it occurs.
+bool save_session(table const& env, std::string const& path)
+{
+	return save_binary(table({ {"env", encode_strings(env)}, {"version", "1"} }), path);
+}
+
+
+auto load_session(std::string const& path) -> table
+{
+	auto const image = load_binary(path);
+	if (image["type"] == "error")
+	{
+		return image;
+	}
+	if (image["version"] != "1")
+	{
+		return make_error(format_error, "Not a session image");
+	}
+	return image["env"];
+}
+
+
+// Disk environments live in a B+-tree file, so only the pages that lookups
+// touch are read. An existing file is opened; otherwise env is written to a
+// new one.
+constexpr std::size_t disk_cache_bytes = 64 << 20;
+
+auto open_disk_session(table const& env, std::string const& path) -> table
+{
+	std::error_code error;
+	if (std::filesystem::exists(path, error))
+	{
+		return open_disk_table(path, disk_cache_bytes);
+	}
+	return create_disk_table(path, env, disk_cache_bytes);
+}
+
+
+// Adds the entries of a JSON object to the environment. A disk environment
+// takes them into its file, and opens to them from then on.
+auto load_prelude(table const& env, std::string const& path) -> table
+{
+	auto const prelude = load_json(path);
+	if (prelude["type"] == "error")
+	{
+		return prelude;
+	}
+	if (prelude.is_string())
+	{
+		return make_error(format_error, "Prelude is not a JSON object");
+	}
+	if (dynamic_cast<btree_view const*>(env.source()))
+	{
+		auto result = env;
+		prelude.for_each([&](table const& key, table const& value) { result = result.with(key, value); });
+		return commit_disk_table(result) ? result : make_error(io_error, "Cannot commit disk environment");
+	}
+	if (env.empty())
+	{
+		return prelude;
+	}
+
+	// Built in one pass over each; the builder keeps the later of equal keys,
+	// so the prelude's entries win.
+	table_builder result;
+	auto const add = [&](table const& key, table const& value) { result.add(key, value); };
+	env.for_each(add);
+	prelude.for_each(add);
+	return result.build();
+}
+
+
+// Adds the rows of a CSV file to the environment, stored by column, bound to the
+// name of the file without its extension.
+auto load_rows(table const& env, std::string const& path) -> table
+{
+	auto const rows = load_csv(path);
+	if (rows["type"] == "error")
+	{
+		return rows;
+	}
+	auto const columns = make_columnar(rows);
+	if (columns["type"] == "error")
+	{
+		return columns;
+	}
+	return env.with(intern(std::filesystem::path(path).stem().string()), columns);
+}
+
+
+// Power-of-two bucket of a count, as the key of a histogram: 0, 1, 2-3, 4-7...
+std::string size_bucket(std::size_t n)
+{
+	if (n < 2)
+	{
+		return std::to_string(n);
+	}
+	std::size_t low = 1;
+	while (low * 2 <= n)
+	{
+		low *= 2;
+	}
+	return std::to_string(low) + "-" + std::to_string(low * 2 - 1);
+}
+
+
+// Memory used by the nodes reachable from root, each shared node counted once.
+// Exclusive nodes are those that dropping the caller's root would free: nothing
+// outside the graph holds them and every parent is exclusive itself. The rest are shared
+// with other versions, the intern pool or other threads. Bytes are estimates
+// of the heap blocks: the node, a string's buffer, a map's tree nodes. Tables
+// backed by a source add what the source reports as resident, its own bytes and
+// the tables it keeps, and the values it has been decoded to if it has. Backing
+// that sources may share, such as a document, counts once, as shared since what
+// else holds it is not known, and mapped pages in memory on their own.
+auto footprint(table const& root) -> table
+{
+	REDUCT_TRACE("footprint");
+
+	// Red-black tree node: three links and a colour ahead of the entry.
+	constexpr std::size_t map_entry_bytes = 4 * sizeof(void*) + sizeof(table::values_map::value_type);
+	static std::size_t const small_string = std::string().capacity();
+
+	struct node_info
+	{
+		table_node const* node;
+		std::size_t depth;
+		std::size_t parents = 0; // edges from nodes in the graph
+		std::size_t exclusive_parents = 0;
+		std::size_t held = 0;    // references in kept, below
+		std::size_t first_edge = 0;
+		std::size_t last_edge = 0;
+		std::uint64_t bytes = 0;
+		std::uint64_t tree_bytes = 0; // as if no node were shared
+	};
+
+	std::vector<node_info> nodes;
+	std::vector<std::size_t> edges; // to children, by parent
+	std::unordered_map<table_node const*, std::size_t> index;
+	std::map<std::string, std::uint64_t> depths, fan_outs, key_sizes;
+	std::uint64_t strings = 0, maps = 0, sources = 0, interned = 0, references = 0, backing_bytes = 0, mapped_bytes = 0;
+
+	// Tables sources report are held until the end, so that none is freed while
+	// it is in the graph; their references do not count against exclusivity.
+	std::vector<table> kept;
+	std::unordered_set<void const*> seen;
+
+	auto const add_edge = [&](table_node const* child, std::size_t depth)
+	{
+		if (!child)
+		{
+			return;
+		}
+		++references;
+		auto const found = index.emplace(child, nodes.size());
+		if (found.second)
+		{
+			nodes.push_back({ child, depth + 1 });
+		}
+		++nodes[found.first->second].parents;
+		edges.push_back(found.first->second);
+	};
+
+	// Breadth first, so a node's depth is its shortest path from root.
+	if (root.m_node)
+	{
+		index.emplace(root.m_node, 0);
+		nodes.push_back({ root.m_node, 0 });
+	}
+	for (std::size_t i = 0; i < nodes.size(); ++i)
+	{
+		auto const node = nodes[i].node;
+		auto const depth = nodes[i].depth;
+		std::uint64_t bytes = sizeof(table_node);
+		nodes[i].first_edge = edges.size();
+		++depths[size_bucket(depth)];
+		interned += node->interned() ? 1 : 0;
+
+		if (auto const source = node->source())
+		{
+			++sources;
+			table_source::memory usage;
+			usage.seen = &seen;
+			source->resident(usage);
+			bytes += usage.bytes;
+			backing_bytes += usage.backing;
+			mapped_bytes += usage.mapped;
+			for (auto const& t : usage.tables)
+			{
+				add_edge(t.m_node, depth);
+			}
+			kept.insert(end(kept), std::make_move_iterator(begin(usage.tables)), std::make_move_iterator(end(usage.tables)));
+		}
+
+		if (node->decoded())
+		{
+			if (auto pstr = std::get_if<std::string>(&node->values()))
+			{
+				strings += node->source() ? 0 : 1;
+				bytes += (pstr->capacity() > small_string) ? pstr->capacity() + 1 : 0;
+			}
+			else
+			{
+				auto const& entries = std::get<table::values_map>(node->values());
+				maps += node->source() ? 0 : 1;
+				bytes += entries.size() * map_entry_bytes;
+				++fan_outs[size_bucket(entries.size())];
+				for (auto const& kv : entries)
+				{
+					auto const key = kv.first.as_string();
+					++key_sizes[key ? size_bucket(key->size()) : "table"];
+					add_edge(kv.first.m_node, depth);
+					add_edge(kv.second.m_node, depth);
+				}
+			}
+		}
+		nodes[i].bytes = bytes;
+		nodes[i].last_edge = edges.size();
+	}
+	for (auto const& t : kept)
+	{
+		++nodes[index.at(t.m_node)].held;
+	}
+
+	// Parents before children: tables are immutable, so the graph has no cycles.
+	std::vector<std::size_t> order;
+	std::vector<std::size_t> waiting(nodes.size());
+	std::vector<bool> exclusive(nodes.size());
+	for (std::size_t i = 0; i < nodes.size(); ++i)
+	{
+		waiting[i] = nodes[i].parents;
+	}
+	if (!nodes.empty())
+	{
+		order.push_back(0);
+	}
+	for (std::size_t i = 0; i < order.size(); ++i)
+	{
+		auto const n = order[i];
+		// root is held by the caller as well as by anything it is shared with.
+		auto const refs = nodes[n].node->references();
+		auto const own = static_cast<std::intptr_t>(nodes[n].exclusive_parents + nodes[n].held) + ((n == 0) ? 1 : 0);
+		exclusive[n] = refs && *refs == own;
+		for (auto e = nodes[n].first_edge; e != nodes[n].last_edge; ++e)
+		{
+			auto const c = edges[e];
+			nodes[c].exclusive_parents += exclusive[n] ? 1 : 0;
+			if (--waiting[c] == 0)
+			{
+				order.push_back(c);
+			}
+		}
+	}
+
+	std::uint64_t total_bytes = backing_bytes, exclusive_bytes = 0, exclusive_nodes = 0;
+	for (auto it = order.rbegin(); it != order.rend(); ++it)
+	{
+		auto& info = nodes[*it];
+		info.tree_bytes = info.bytes;
+		for (auto e = info.first_edge; e != info.last_edge; ++e)
+		{
+			// Saturates: a deep graph of shared nodes can describe a tree of
+			// any size.
+			auto const child_bytes = nodes[edges[e]].tree_bytes;
+			info.tree_bytes = std::max(info.tree_bytes, info.tree_bytes + child_bytes);
+		}
+		total_bytes += info.bytes;
+		exclusive_bytes += exclusive[*it] ? info.bytes : 0;
+		exclusive_nodes += exclusive[*it] ? 1 : 0;
+	}
+
+	auto const histogram = [](std::map<std::string, std::uint64_t> const& counts)
+	{
+		table::values_map values;
+		for (auto const& [bucket, count] : counts)
+		{
+			values.emplace(bucket, std::to_string(count));
+		}
+		return table(values);
+	};
+
+	return table({
+		{"nodes", table({
+			{"total", std::to_string(nodes.size())},
+			{"string", std::to_string(strings)},
+			{"map", std::to_string(maps)},
+			{"source", std::to_string(sources)},
+			{"interned", std::to_string(interned)},
+			{"exclusive", std::to_string(exclusive_nodes)},
+			{"shared", std::to_string(nodes.size() - exclusive_nodes)}
+		})},
+		{"bytes", table({
+			{"total", std::to_string(total_bytes)},
+			{"exclusive", std::to_string(exclusive_bytes)},
+			{"shared", std::to_string(total_bytes - exclusive_bytes)},
+			{"unshared", std::to_string((nodes.empty() ? 0 : nodes[0].tree_bytes) + backing_bytes)},
+			{"backing", std::to_string(backing_bytes)},
+			{"mapped", std::to_string(mapped_bytes)}
+		})},
+		{"references", std::to_string(references)},
+		{"depth", histogram(depths)},
+		{"fan-out", histogram(fan_outs)},
+		{"key-size", histogram(key_sizes)}
+	});
+}
+
+
+// CPU time of the calling thread in nanoseconds, so that other threads, such as
+// server workers, do not add to what a probe on this one measures.
+std::uint64_t thread_cpu_time()
+{
+#ifdef _WIN32
+	FILETIME created, exited, kernel, user;
+	if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user))
+	{
+		return 0;
+	}
+	auto const ticks = [](FILETIME const& t) { return (std::uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+	return (ticks(kernel) + ticks(user)) * 100;
+#else
+	timespec now{};
+	::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return static_cast<std::uint64_t>(now.tv_sec) * 1000000000 + static_cast<std::uint64_t>(now.tv_nsec);
+#endif
+}
+
+
+// A point in time for :time and :alloc: wall clock, CPU time and counters of
+// this thread.
+struct probe
+{
+	std::chrono::steady_clock::time_point wall = std::chrono::steady_clock::now();
+	std::uint64_t cpu = thread_cpu_time(); // ns
+#ifdef REDUCT_INSTRUMENTATION
+	op_counters counters = thread_counters().snapshot();
+#endif
+};
+
+
+auto probe_difference(probe const& before, probe const& after, bool times, bool counts) -> table
+{
+	table::values_map report;
+	if (times)
+	{
+		report.emplace("wall-us", format_number(std::chrono::duration<double, std::micro>(after.wall - before.wall).count()));
+		report.emplace("cpu-us", format_number(static_cast<double>(after.cpu - before.cpu) / 1e3));
+	}
+#ifdef REDUCT_INSTRUMENTATION
+	if (counts)
+	{
+		op_counters difference;
+		for (std::size_t i = 0; i < op_counter_count; ++i)
+		{
+			difference[i] = after.counters[i] - before.counters[i];
+		}
+		counters_table(difference).for_each([&](table const& key, table const& value) { report.emplace(key, value); });
+	}
+#else
+	(void)counts;
+#endif
+	return report;
+}
+
+
+// Evaluates a whole form as one traced span; the nested evaluations it makes
+// would otherwise flood the trace.
+auto evaluate_form(table const& expr, table const& env) -> table
+{
+	REDUCT_TRACE("evaluate");
+	return evaluate(expr, env);
+}
+
+
+// Reads, evaluates and prints input, reporting the time each step took or what
+// it counted.
+auto profile(std::string const& input, table const& env, bool times, bool counts) -> table
+{
+	probe const start;
+	table const expr = read(input);
+	probe const read_done;
+	table const value = evaluate(expr, env);
+	probe const evaluated;
+	std::string const text = pretty(value);
+	probe const printed;
+	return table({
+		{"result", value},
+		{"read", probe_difference(start, read_done, times, counts)},
+		{"evaluate", probe_difference(read_done, evaluated, times, counts)},
+		{"print", probe_difference(evaluated, printed, times, counts)}
+	});
+}
+
+
+// One line of REPL input: a command or an expression to evaluate. :save FILE
+// writes a session image, :cache shows the parse cache, :footprint EXPR shows
+// the memory the value of EXPR takes and shares, :time EXPR and :alloc EXPR
+// read, evaluate and print EXPR with timings or counts of each step, :stats
+// shows the counts of all threads so far and :trace FILE writes the spans
+// recorded so far. On columnar tables, such as the ones --csv loads, :where
+// COLUMN VALUE EXPR and :range COLUMN LOW HIGH EXPR select rows and :aggregate
+// COLUMN EXPR sums up a column. :concat A B joins the strings A and B evaluate
+// to, B being the last form on the line, and :substring POS COUNT EXPR cuts
+// one; long results are ropes that share the text they came from.
+auto run_line(std::string const& input, table const& env) -> table
+{
+	if (input.compare(0, 6, ":save ") == 0)
+	{
+		return save_session(env, input.substr(6)) ? table("saved") : make_error(io_error, "Cannot save");
+	}
+	if (input == ":cache")
+	{
+		return parsed().stats();
+	}
+	if (input.compare(0, 11, ":footprint ") == 0)
+	{
+		return footprint(evaluate_form(parsed().parse(input.substr(11)), env));
+	}
+	if (input.compare(0, 6, ":time ") == 0)
+	{
+		return profile(input.substr(6), env, true, false);
+	}
+	if (input.compare(0, 8, ":concat ") == 0)
+	{
+		auto const expr = parsed().parse(input.substr(8));
+		if (expr["type"] != "lookup-expression" || expr["key"] == lookup_error)
+		{
+			return make_error(read_error, "Expected :concat A B");
+		}
+		return concat(evaluate_form(expr["map"], env), evaluate_form(expr["key"], env));
+	}
+	if (input.compare(0, 11, ":substring ") == 0)
+	{
+		std::istringstream args(input.substr(11));
+		std::size_t pos, count;
+		std::string expr;
+		if (!(args >> pos >> count) || !std::getline(args, expr))
+		{
+			return make_error(read_error, "Expected :substring POS COUNT EXPR");
+		}
+		return substring(evaluate_form(parsed().parse(expr), env), pos, count);
+	}
+	if (input.compare(0, 7, ":where ") == 0)
+	{
+		std::istringstream args(input.substr(7));
+		std::string column, value, expr;
+		if (!(args >> column >> value) || !std::getline(args, expr))
+		{
+			return make_error(read_error, "Expected :where COLUMN VALUE EXPR");
+		}
+		return select_equal(evaluate_form(parsed().parse(expr), env), intern(column), value);
+	}
+	if (input.compare(0, 7, ":range ") == 0)
+	{
+		std::istringstream args(input.substr(7));
+		std::string column, low, high, expr;
+		double low_number, high_number;
+		if (!(args >> column >> low >> high) || !std::getline(args, expr)
+			|| !parse_double(low, low_number) || !parse_double(high, high_number))
+		{
+			return make_error(read_error, "Expected :range COLUMN LOW HIGH EXPR");
+		}
+		return select_range(evaluate_form(parsed().parse(expr), env), intern(column), low_number, high_number);
+	}
+	if (input.compare(0, 11, ":aggregate ") == 0)
+	{
+		std::istringstream args(input.substr(11));
+		std::string column, expr;
+		if (!(args >> column) || !std::getline(args, expr))
+		{
+			return make_error(read_error, "Expected :aggregate COLUMN EXPR");
+		}
+		return aggregate(evaluate_form(parsed().parse(expr), env), intern(column));
+	}
+#ifdef REDUCT_INSTRUMENTATION
+	if (input.compare(0, 7, ":alloc ") == 0)
+	{
+		return profile(input.substr(7), env, false, true);
+	}
+	if (input == ":stats")
+	{
+		return counters_table(all_counters());
+	}
+#endif
+#ifdef REDUCT_TRACING
+	if (input.compare(0, 7, ":trace ") == 0)
+	{
+		return tracing::save(input.substr(7)) ? table("saved") : make_error(io_error, "Cannot write trace");
+	}
+#endif
+	return evaluate_form(parsed().parse(input), env);
+}
+
+
+bool stdin_is_terminal()
+{
+#ifdef _WIN32
+	return _isatty(_fileno(stdin)) != 0;
+#else
+	return ::isatty(STDIN_FILENO) != 0;
+#endif
+}
+
+
+#ifdef REDUCT_IO_URING
+// A minimal io_uring instance driven by the raw system calls: one submission
+// and one completion ring shared with the kernel. Entries are queued with
+// prepare() and handed over in one go by submit(), which can also wait for
+// completions, so a whole batch of reads and writes costs one system call.
+class io_ring
+{
+public:
+	explicit io_ring(unsigned entries)
+	{
+		io_uring_params params{};
+		m_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+		if (m_fd < 0)
+		{
+			return;
+		}
+
+		m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+		}
+		m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		m_sq = ::mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+		m_cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? m_sq
+			: ::mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		void* const sqes = ::mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+		if (m_sq == MAP_FAILED || m_cq == MAP_FAILED || sqes == MAP_FAILED)
+		{
+			m_sq = m_sq == MAP_FAILED ? nullptr : m_sq;
+			m_cq = m_cq == MAP_FAILED ? nullptr : m_cq;
+			if (sqes != MAP_FAILED)
+			{
+				::munmap(sqes, m_sqes_size);
+			}
+			close();
+			return;
+		}
+
+		auto const sq = static_cast<char*>(m_sq);
+		auto const cq = static_cast<char*>(m_cq);
+		m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		m_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		m_sq_entries = params.sq_entries;
+		m_sqes = static_cast<io_uring_sqe*>(sqes);
+		m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		m_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+		m_tail = *m_sq_tail;
+	}
+
+	~io_ring()
+	{
+		close();
+	}
+
+	io_ring(io_ring const&) = delete;
+	io_ring& operator= (io_ring const&) = delete;
+
+	bool is_open() const
+	{
+		return m_fd >= 0;
+	}
+
+	// Whether the kernel has all of the operations. Setting up a ring only needs
+	// 5.1, and operations it does not have fail with -EINVAL when used; kernels
+	// before 5.6 cannot be asked, and have neither IORING_OP_READ nor this.
+	bool supports(std::initializer_list<std::uint8_t> opcodes) const
+	{
+		constexpr unsigned probe_ops = 256;
+		std::vector<char> buffer(sizeof(io_uring_probe) + probe_ops * sizeof(io_uring_probe_op));
+		auto const probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+		if (::syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, probe_ops) != 0)
+		{
+			return false;
+		}
+		return std::all_of(begin(opcodes), end(opcodes), [&](std::uint8_t op)
+		{
+			return op <= probe->last_op && op < probe->ops_len && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+		});
+	}
+
+	// Registers buffers for the *_FIXED operations, which then skip mapping
+	// the memory on every call; buf_index in an entry refers to them.
+	bool register_buffers(iovec const* buffers, unsigned count)
+	{
+		return ::syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+	}
+
+	// A cleared entry for opcode on fd, queued for the next submit(); submits
+	// what is queued first if the ring is full.
+	io_uring_sqe* prepare(std::uint8_t opcode, int fd, std::uint64_t user_data)
+	{
+		if (m_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) == m_sq_entries)
+		{
+			submit();
+		}
+		auto const index = m_tail & m_sq_mask;
+		auto const sqe = &m_sqes[index];
+		std::memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = opcode;
+		sqe->fd = fd;
+		sqe->user_data = user_data;
+		m_sq_array[index] = index;
+		++m_tail;
+		return sqe;
+	}
+
+	// Hands the queued entries to the kernel and waits until at least
+	// wait_for completions are there. Returns false on failure.
+	bool submit(unsigned wait_for = 0)
+	{
+		__atomic_store_n(m_sq_tail, m_tail, __ATOMIC_RELEASE);
+		auto const queued = m_tail - m_submitted;
+		while (true)
+		{
+			auto const done = ::syscall(__NR_io_uring_enter, m_fd, queued, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0u, nullptr, 0);
+			if (done >= 0)
+			{
+				m_submitted += static_cast<unsigned>(done);
+				return true;
+			}
+			if (errno != EINTR)
+			{
+				return false;
+			}
+		}
+	}
+
+	// Calls f(user_data, result) for each completion that has arrived; f may
+	// prepare new entries. Returns the number of completions.
+	template <typename F>
+	unsigned complete(F&& f)
+	{
+		unsigned count = 0;
+		auto head = *m_cq_head;
+		while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+		{
+			auto const& cqe = m_cqes[head & m_cq_mask];
+			auto const user_data = cqe.user_data;
+			auto const result = cqe.res;
+			__atomic_store_n(m_cq_head, ++head, __ATOMIC_RELEASE);
+			f(user_data, result);
+			++count;
+		}
+		return count;
+	}
+
+private:
+	void close()
+	{
+		if (m_sqes)
+		{
+			::munmap(m_sqes, m_sqes_size);
+		}
+		if (m_cq && m_cq != m_sq)
+		{
+			::munmap(m_cq, m_cq_size);
+		}
+		if (m_sq)
+		{
+			::munmap(m_sq, m_sq_size);
+		}
+		if (m_fd >= 0)
+		{
+			::close(m_fd);
+		}
+		m_sqes = nullptr;
+		m_sq = m_cq = nullptr;
+		m_fd = -1;
+	}
+
+	int m_fd = -1;
+	void* m_sq = nullptr;
+	void* m_cq = nullptr;
+	std::size_t m_sq_size = 0;
+	std::size_t m_cq_size = 0;
+	std::size_t m_sqes_size = 0;
+	unsigned* m_sq_head = nullptr;
+	unsigned* m_sq_tail = nullptr;
+	unsigned* m_sq_array = nullptr;
+	unsigned m_sq_mask = 0;
+	unsigned m_sq_entries = 0;
+	unsigned m_tail = 0;
+	unsigned m_submitted = 0;
+	io_uring_sqe* m_sqes = nullptr;
+	unsigned* m_cq_head = nullptr;
+	unsigned* m_cq_tail = nullptr;
+	unsigned m_cq_mask = 0;
+	io_uring_cqe* m_cqes = nullptr;
+};
+#endif
+
+
+// How the server and batch modes do their I/O: through io_uring where the
+// kernel has it, or with one read or write system call at a time.
+enum class io_backend
+{
+	uring,
+	basic,
+};
+
+
+// Reads a file front to back in blocks. With io_uring, the reads of the next
+// blocks are in flight while the caller works on the current one, into buffers
+// registered with the kernel once; regular files have several reads in flight
+// at consecutive offsets, pipes one. Otherwise it is one fread() per block.
+class block_reader
+{
+public:
+	block_reader(std::FILE* in, std::size_t block_size, io_backend io = io_backend::uring)
+		: m_in(in)
+		, m_block_size(block_size)
+	{
+#ifdef REDUCT_IO_URING
+		struct stat st;
+		int const fd = ::fileno(in);
+		if (io == io_backend::uring && ::fstat(fd, &st) == 0)
+		{
+			m_depth = S_ISREG(st.st_mode) ? 4 : 1;
+			m_ring = std::make_unique<io_ring>(8);
+			if (m_ring->is_open() && m_ring->supports({ IORING_OP_READ, IORING_OP_READ_FIXED }))
+			{
+				m_fd = fd;
+				m_regular = S_ISREG(st.st_mode);
+				m_offset = m_regular ? static_cast<std::uint64_t>(::lseek(fd, 0, SEEK_CUR)) : 0;
+				m_buffers.resize(m_depth + 1);
+				std::vector<iovec> registered;
+				for (auto& buffer : m_buffers)
+				{
+					buffer.data.reset(new char[block_size]);
+					registered.push_back({ buffer.data.get(), block_size });
+				}
+				m_fixed = m_ring->register_buffers(registered.data(), static_cast<unsigned>(registered.size()));
+				for (unsigned i = 0; i < m_depth; ++i)
+				{
+					request(i);
+				}
+				return;
+			}
+			m_ring.reset();
+		}
+#else
+		(void)io;
+#endif
+		m_block.resize(block_size);
+	}
+
+	block_reader(block_reader const&) = delete;
+	block_reader& operator= (block_reader const&) = delete;
+
+	~block_reader()
+	{
+#ifdef REDUCT_IO_URING
+		// The kernel may still be writing into the buffers.
+		while (m_ring && m_in_flight > 0 && m_ring->submit(1))
+		{
+			m_ring->complete([&](std::uint64_t, int) { --m_in_flight; });
+		}
+#endif
+	}
+
+	// The next block of the file, valid until the next call; empty at the end
+	// of the file or on an error.
+	std::string_view next()
+	{
+#ifdef REDUCT_IO_URING
+		if (m_ring)
+		{
+			return next_from_ring();
+		}
+#endif
+		auto const count = std::fread(m_block.data(), 1, m_block.size(), m_in);
+		m_failed = m_failed || std::ferror(m_in);
+		return std::string_view(m_block.data(), count);
+	}
+
+	bool failed() const
+	{
+		return m_failed;
+	}
+
+private:
+#ifdef REDUCT_IO_URING
+	struct buffer
+	{
+		std::unique_ptr<char[]> data;
+		std::uint64_t offset = 0;
+		int result = 0;
+		bool done = false;
+	};
+
+	void request(unsigned index)
+	{
+		auto& slot = m_buffers[index];
+		slot.done = false;
+		slot.offset = m_offset;
+		auto const sqe = m_ring->prepare(m_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, m_fd, index);
+		sqe->addr = reinterpret_cast<std::uint64_t>(slot.data.get());
+		sqe->len = static_cast<std::uint32_t>(m_block_size);
+		sqe->off = m_regular ? m_offset : static_cast<std::uint64_t>(-1);
+		sqe->buf_index = static_cast<std::uint16_t>(index);
+		m_offset += m_block_size;
+		++m_in_flight;
+	}
+
+	std::string_view next_from_ring()
+	{
+		if (m_end)
+		{
+			return {};
+		}
+
+		// Blocks come back in the order they were asked for; the one handed
+		// out last time is free again and reads the next block ahead.
+		if (m_handed_out)
+		{
+			request((m_current + m_depth) % (m_depth + 1));
+			m_current = (m_current + 1) % (m_depth + 1);
+		}
+		m_handed_out = true;
+		auto& slot = m_buffers[m_current];
+		while (!slot.done)
+		{
+			if (!m_ring->submit(1))
+			{
+				m_failed = true;
+				m_end = true;
+				return {};
+			}
+			m_ring->complete([&](std::uint64_t index, int result)
+			{
+				m_buffers[index].result = result;
+				m_buffers[index].done = true;
+				--m_in_flight;
+			});
+		}
+
+		auto size = slot.result;
+		if (size < 0)
+		{
+			m_failed = true;
+			m_end = true;
+			return {};
+		}
+		// A short read of a regular file before its end is finished in place,
+		// so the blocks after it stay at their offsets.
+		while (m_regular && size > 0 && static_cast<std::size_t>(size) < m_block_size)
+		{
+			auto const more = ::pread(m_fd, slot.data.get() + size, m_block_size - size, static_cast<off_t>(slot.offset + size));
+			if (more <= 0)
+			{
+				m_failed = m_failed || more < 0;
+				break;
+			}
+			size += static_cast<int>(more);
+		}
+		if (size == 0)
+		{
+			m_end = true;
+			return {};
+		}
+		return std::string_view(slot.data.get(), static_cast<std::size_t>(size));
+	}
+
+	std::unique_ptr<io_ring> m_ring;
+	std::vector<buffer> m_buffers;
+	int m_fd = -1;
+	bool m_regular = false;
+	bool m_fixed = false;
+	bool m_end = false;
+	bool m_handed_out = false;
+	unsigned m_depth = 1;
+	unsigned m_current = 0;
+	unsigned m_in_flight = 0;
+	std::uint64_t m_offset = 0;
+#endif
+
+	std::FILE* m_in;
+	std::size_t m_block_size;
+	std::vector<char> m_block;
+	bool m_failed = false;
+};
+
+
+// Bounded multi-producer multi-consumer queue on a ring of cells, each with a
+// sequence number that says whether it is ready to be written or read in the
+// current lap (D. Vyukov's design). No locks while there is room or work; push()
+// waits while the queue is full, which is what slows a producer down to its
+// consumers. A waiting thread retries a few times and then sleeps until the
+// other side makes progress, so idle stages do not hold on to a core.
+template <typename T>
+class bounded_queue
+{
+public:
+	// capacity must be a power of two.
+	explicit bounded_queue(std::size_t capacity)
+		: m_cells(capacity)
+		, m_mask(capacity - 1)
+	{
+		for (std::size_t i = 0; i < capacity; ++i)
+		{
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	bool try_push(T& value)
+	{
+		auto pos = m_tail.load(std::memory_order_relaxed);
+		while (true)
+		{
+			auto& cell = m_cells[pos & m_mask];
+			auto const diff = static_cast<std::intptr_t>(cell.sequence.load(std::memory_order_acquire)) - static_cast<std::intptr_t>(pos);
+			if (diff == 0)
+			{
+				if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					cell.value = std::move(value);
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = m_tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool try_pop(T& value)
+	{
+		auto pos = m_head.load(std::memory_order_relaxed);
+		while (true)
+		{
+			auto& cell = m_cells[pos & m_mask];
+			auto const diff = static_cast<std::intptr_t>(cell.sequence.load(std::memory_order_acquire)) - static_cast<std::intptr_t>(pos + 1);
+			if (diff == 0)
+			{
+				if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					value = std::move(cell.value);
+					cell.sequence.store(pos + m_mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = m_head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void push(T value)
+	{
+		if (!spin([&] { return try_push(value); }))
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_push_waiting.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while (!try_push(value))
+			{
+				m_not_full.wait(lock);
+			}
+			m_push_waiting.fetch_sub(1, std::memory_order_relaxed);
+		}
+		wake(m_pop_waiting, m_not_empty);
+	}
+
+	T pop()
+	{
+		T value;
+		if (!spin([&] { return try_pop(value); }))
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_pop_waiting.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while (!try_pop(value))
+			{
+				m_not_empty.wait(lock);
+			}
+			m_pop_waiting.fetch_sub(1, std::memory_order_relaxed);
+		}
+		wake(m_push_waiting, m_not_full);
+		return value;
+	}
+
+private:
+	static constexpr int spin_limit = 16;
+
+	template <typename F>
+	static bool spin(F&& attempt)
+	{
+		for (int i = 0; i < spin_limit; ++i)
+		{
+			if (attempt())
+			{
+				return true;
+			}
+			std::this_thread::yield();
+		}
+		return false;
+	}
+
+	// Pairs with the fence a waiter makes after counting itself: either it sees
+	// this side's change when it retries, or this side sees it waiting. The
+	// mutex makes sure it is inside wait() by the time it is notified.
+	void wake(std::atomic<unsigned>& waiting, std::condition_variable& sleepers)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting.load(std::memory_order_relaxed) != 0)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			sleepers.notify_one();
+		}
+	}
+
+	struct cell
+	{
+		std::atomic<std::size_t> sequence;
+		T value;
+	};
+
+	std::vector<cell> m_cells;
+	std::size_t const m_mask;
+	alignas(64) std::atomic<std::size_t> m_head{ 0 };
+	alignas(64) std::atomic<std::size_t> m_tail{ 0 };
+
+	alignas(64) std::mutex m_mutex;
+	std::condition_variable m_not_empty;
+	std::condition_variable m_not_full;
+	std::atomic<unsigned> m_pop_waiting{ 0 };
+	std::atomic<unsigned> m_push_waiting{ 0 };
+};
+
+
+// Evaluates every line of in, without prompts, until end of input. Input is read
+// in large blocks into buffers that are reused for every line, and results go
+// through one large output buffer instead of being flushed per line. Returns the
+// exit status: 1 if any line evaluated to an error, else 0.
+int run_batch(std::FILE* in, table const& env, unsigned threads, io_backend io = io_backend::uring);
+
+
+int run_batch(std::FILE* in, table const& env, io_backend io)
+{
+	std::ios::sync_with_stdio(false);
+	static char output_buffer[1 << 20];
+	std::cout.rdbuf()->pubsetbuf(output_buffer, sizeof(output_buffer));
+
+	int status = 0;
+	std::size_t since_sweep = 0;
+	block_reader reader(in, 1 << 20, io);
+	std::string line;
+	auto run = [&]()
+	{
+		if (!line.empty() && line.back() == '\r')
+		{
+			line.pop_back();
+		}
+		if (line.empty())
+		{
+			return;
+		}
+		table const value = run_line(line, env);
+		if (value["type"] == "error")
+		{
+			status = 1;
+		}
+		std::cout << value << '\n';
+		if (++since_sweep == sweep_interval)
+		{
+			interned().sweep();
+			since_sweep = 0;
+		}
+	};
+
+	for (auto block = reader.next(); !block.empty(); block = reader.next())
+	{
+		char const* p = block.data();
+		auto const last = p + block.size();
+		while (auto const newline = static_cast<char const*>(std::memchr(p, '\n', last - p)))
+		{
+			line.append(p, newline);
+			run();
+			line.clear();
+			p = newline + 1;
+		}
+		line.append(p, last);
+	}
+	run();
+	interned().sweep();
+
+	std::cout.flush();
+	return (reader.failed() || !std::cout) ? 1 : status;
+}
+
+
+// Batch mode as a pipeline: this thread reads blocks of whole lines, a pool of
+// workers evaluates and prints them to text, and a writer thread puts the text
+// out in input order, holding back blocks that finish early. The queues are
+// bounded, so a slow stage holds up the ones before it instead of letting work
+// pile up in memory.
+int run_batch(std::FILE* in, table const& env, unsigned threads, io_backend io)
+{
+	if (threads <= 1)
+	{
+		return run_batch(in, env, io);
+	}
+
+	std::ios::sync_with_stdio(false);
+	static char output_buffer[1 << 20];
+	std::cout.rdbuf()->pubsetbuf(output_buffer, sizeof(output_buffer));
+
+	// A block of input or output lines; an empty block without lines marks the
+	// end of a worker's input, or a worker having finished.
+	struct block
+	{
+		std::size_t sequence = 0;
+		std::string text;
+		bool end = false;
+		bool error = false;
+	};
+	bounded_queue<block> input(64);
+	bounded_queue<block> output(64);
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < threads; ++i)
+	{
+		workers.emplace_back([&]()
+		{
+			std::string line;
+			while (true)
+			{
+				auto in_block = input.pop();
+				if (in_block.end)
+				{
+					output.push(std::move(in_block));
+					return;
+				}
+
+				REDUCT_TRACE("batch-block");
+				block out_block;
+				out_block.sequence = in_block.sequence;
+				char const* p = in_block.text.data();
+				auto const last = p + in_block.text.size();
+				while (p != last)
+				{
+					auto const newline = static_cast<char const*>(std::memchr(p, '\n', last - p));
+					auto const end = newline ? newline : last;
+					line.assign(p, (end != p && end[-1] == '\r') ? end - 1 : end);
+					p = newline ? newline + 1 : last;
+					if (line.empty())
+					{
+						continue;
+					}
+
+					table const value = run_line(line, env);
+					out_block.error = out_block.error || (value["type"] == "error");
+					print_to(out_block.text, value);
+					out_block.text += '\n';
+				}
+				output.push(std::move(out_block));
+			}
+		});
+	}
+
+	int status = 0;
+	std::thread writer([&]()
+	{
+		std::map<std::size_t, block> early;
+		std::size_t next = 0;
+		unsigned finished = 0;
+		while (finished < threads)
+		{
+			auto out_block = output.pop();
+			if (out_block.end)
+			{
+				++finished;
+				continue;
+			}
+			early.emplace(out_block.sequence, std::move(out_block));
+			for (auto it = early.begin(); it != early.end() && it->first == next; it = early.erase(it), ++next)
+			{
+				status |= it->second.error ? 1 : 0;
+				std::cout.write(it->second.text.data(), static_cast<std::streamsize>(it->second.text.size()));
+			}
+		}
+		std::cout.flush();
+	});
+
+	// Blocks end at a line break; the rest of a read waits for the next one.
+	// The pool is swept every few blocks; lines are assumed to be around a
+	// hundred bytes long.
+	constexpr std::size_t block_size = 64 * 1024;
+	constexpr std::size_t sweep_blocks = sweep_interval * 100 / block_size;
+	std::size_t sequence = 0;
+	std::string pending;
+	block_reader reader(in, block_size, io);
+	for (auto data = reader.next(); !data.empty(); data = reader.next())
+	{
+		pending.append(data.data(), data.size());
+		auto const cut = pending.rfind('\n');
+		if (cut == std::string::npos || cut + 1 < block_size / 2)
+		{
+			continue;
+		}
+		block in_block;
+		in_block.sequence = sequence++;
+		in_block.text.assign(pending, 0, cut + 1);
+		pending.erase(0, cut + 1);
+		input.push(std::move(in_block));
+		if (sequence % sweep_blocks == 0)
+		{
+			interned().sweep();
+		}
+	}
+	if (!pending.empty())
+	{
+		block in_block;
+		in_block.sequence = sequence++;
+		in_block.text = std::move(pending);
+		input.push(std::move(in_block));
+	}
+	for (unsigned i = 0; i < threads; ++i)
+	{
+		block end_block;
+		end_block.end = true;
+		input.push(std::move(end_block));
+	}
+
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	writer.join();
+	interned().sweep();
+	return (reader.failed() || !std::cout) ? 1 : status;
+}
+
+
+#ifdef __linux__
+// Messages on a server socket are framed as a 32-bit little-endian length
+// followed by that many bytes. A request is one line of input and the response
+// is the printed result, as batch mode would print it.
+namespace framing
+{
+	constexpr std::size_t header_size = 4;
+	constexpr std::size_t max_payload = 16 << 20;
+
+	inline void write_header(char* header, std::size_t payload_size)
+	{
+		auto const size = static_cast<std::uint32_t>(payload_size);
+		header[0] = static_cast<char>(size & 0xff);
+		header[1] = static_cast<char>((size >> 8) & 0xff);
+		header[2] = static_cast<char>((size >> 16) & 0xff);
+		header[3] = static_cast<char>((size >> 24) & 0xff);
+	}
+
+	inline void append(std::string& out, std::string_view payload)
+	{
+		char header[header_size];
+		write_header(header, payload.size());
+		out.append(header, header_size);
+		out.append(payload);
+	}
+
+	inline std::uint32_t payload_size(char const* header)
+	{
+		auto const byte = [&](int i) { return static_cast<std::uint32_t>(static_cast<unsigned char>(header[i])); };
+		return byte(0) | (byte(1) << 8) | (byte(2) << 16) | (byte(3) << 24);
+	}
+}
+
+
+// Serves requests on a Unix domain socket. One thread runs the I/O for all
+// connections and a pool of workers evaluates requests against one environment
+// that none of them changes. Each connection has one request with the workers
+// at a time, so its responses come back in order, while different connections
+// are evaluated in parallel.
+//
+// With io_uring, the I/O thread keeps an accept, a receive per connection and
+// the sends in flight in one ring, receiving into buffers registered with the
+// kernel and sending responses straight from the workers' strings, so a round
+// of I/O for many connections costs one system call. Otherwise it waits on
+// epoll and makes one call per read and write.
+class socket_server
+{
+public:
+	socket_server(table env, unsigned threads, io_backend io = io_backend::uring)
+		: m_env(std::move(env))
+		, m_threads(std::max(threads, 1u))
+		, m_io(io)
+	{
+	}
+
+	socket_server(socket_server const&) = delete;
+	socket_server& operator=(socket_server const&) = delete;
+
+	~socket_server()
+	{
+		for (int const fd : { m_epoll, m_wake, m_listen })
+		{
+			if (fd >= 0)
+			{
+				::close(fd);
+			}
+		}
+	}
+
+	// Listens on path until stop() is called; returns the exit status.
+	int run(std::string const& path)
+	{
+		sockaddr_un address{};
+		address.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(address.sun_path))
+		{
+			std::cerr << "Socket path too long: " << path << "\n";
+			return 1;
+		}
+		std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+		m_listen = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		m_wake = ::eventfd(0, EFD_CLOEXEC);
+		::unlink(path.c_str());
+		if (m_listen < 0 || m_wake < 0
+			|| ::bind(m_listen, reinterpret_cast<sockaddr const*>(&address), sizeof(address)) != 0
+			|| ::listen(m_listen, SOMAXCONN) != 0)
+		{
+			std::cerr << "Cannot listen on " << path << ": " << std::strerror(errno) << "\n";
+			return 1;
+		}
+
+		std::vector<std::thread> workers;
+		for (unsigned i = 0; i < m_threads; ++i)
+		{
+			workers.emplace_back([this]() { work(); });
+		}
+
+		bool served = false;
+#ifdef REDUCT_IO_URING
+		if (m_io == io_backend::uring)
+		{
+			m_ring = std::make_unique<io_ring>(4096);
+			served = m_ring->is_open()
+				&& m_ring->supports({ IORING_OP_ACCEPT, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_ASYNC_CANCEL })
+				&& serve_ring();
+			m_ring.reset();
+		}
+#endif
+		int status = 0;
+		if (!served && !serve_epoll())
+		{
+			std::cerr << "Cannot serve on " << path << ": " << std::strerror(errno) << "\n";
+			status = 1;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_tasks_mutex);
+			m_tasks_closed = true;
+		}
+		m_tasks_ready.notify_all();
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+		for (auto& entry : m_connections)
+		{
+			::close(entry.first);
+		}
+		m_connections.clear();
+		::unlink(path.c_str());
+		return status;
+	}
+
+	void stop()
+	{
+		m_stopping.store(true, std::memory_order_release);
+		wake();
+	}
+
+private:
+	// Requests and responses carry the generation of their connection, so a
+	// response for a connection that closed, and whose descriptor was reused,
+	// is dropped.
+	struct task
+	{
+		int fd = -1;
+		std::uint64_t generation = 0;
+		std::string text;
+		char header[framing::header_size];
+	};
+
+	// The buffers of a connection are its arena: they keep their capacity from
+	// one request to the next, and so do the buffers each worker evaluates and
+	// prints with, so a connection in steady use makes no allocations for I/O.
+	struct connection
+	{
+		std::uint64_t generation = 0;
+		std::string input;
+		std::size_t consumed = 0;
+		std::string output;
+		std::size_t written = 0;
+		bool busy = false;
+		bool writing = false;
+		bool closing = false;
+		std::uint32_t interest = EPOLLIN | EPOLLRDHUP; // epoll events watched
+#ifdef REDUCT_IO_URING
+		// Receive buffer: one of the registered ones, or its own if they are
+		// all taken.
+		int slot = -1;
+		std::unique_ptr<char[]> own;
+		// Responses being sent, as a list of header and text pieces, and the
+		// ones that arrived meanwhile.
+		std::vector<task> sending;
+		std::vector<task> queued;
+		std::vector<iovec> pieces;
+		std::size_t first_piece = 0;
+		msghdr message{};
+		unsigned in_flight = 0;
+		bool shut = false;
+#endif
+	};
+
+	void wake()
+	{
+		std::uint64_t const one = 1;
+		[[maybe_unused]] auto const written = ::write(m_wake, &one, sizeof(one));
+	}
+
+	bool serve_epoll()
+	{
+		m_epoll = ::epoll_create1(EPOLL_CLOEXEC);
+		if (m_epoll < 0)
+		{
+			return false;
+		}
+		::fcntl(m_listen, F_SETFL, ::fcntl(m_listen, F_GETFL) | O_NONBLOCK);
+		::fcntl(m_wake, F_SETFL, ::fcntl(m_wake, F_GETFL) | O_NONBLOCK);
+		watch(m_listen, EPOLLIN, EPOLL_CTL_ADD);
+		watch(m_wake, EPOLLIN, EPOLL_CTL_ADD);
+
+		std::array<epoll_event, 64> events;
+		while (!m_stopping.load(std::memory_order_acquire))
+		{
+			int const count = ::epoll_wait(m_epoll, events.data(), static_cast<int>(events.size()), -1);
+			for (int i = 0; i < count; ++i)
+			{
+				int const fd = events[i].data.fd;
+				if (fd == m_listen)
+				{
+					accept_all();
+				}
+				else if (fd == m_wake)
+				{
+					std::uint64_t value;
+					[[maybe_unused]] auto const read = ::read(m_wake, &value, sizeof(value));
+					finish_requests();
+				}
+				else
+				{
+					serve(fd, events[i].events);
+				}
+			}
+		}
+		return true;
+	}
+
+	void watch(int fd, std::uint32_t events, int operation)
+	{
+		epoll_event event{};
+		event.events = events;
+		event.data.fd = fd;
+		::epoll_ctl(m_epoll, operation, fd, &event);
+	}
+
+	// Input until the connection is closing, output while some is pending. A
+	// closing connection only waits for its requests and their responses, and
+	// a half-closed socket would report input on every wait until then. Its
+	// events are one-shot, so that a reset does not do the same, and are armed
+	// again while output is pending.
+	void update_interest(int fd, connection& conn)
+	{
+		std::uint32_t const events = (conn.closing ? EPOLLONESHOT : (EPOLLIN | EPOLLRDHUP)) | (conn.writing ? EPOLLOUT : 0);
+		if (events != conn.interest || (conn.closing && conn.writing))
+		{
+			conn.interest = events;
+			watch(fd, events, EPOLL_CTL_MOD);
+		}
+	}
+
+	connection& open_connection(int fd)
+	{
+		auto& conn = m_connections[fd];
+		conn = connection();
+		conn.generation = ++m_generation;
+		return conn;
+	}
+
+	void accept_all()
+	{
+		while (true)
+		{
+			int const fd = ::accept4(m_listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0)
+			{
+				return;
+			}
+			open_connection(fd);
+			watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+		}
+	}
+
+	void close_connection(int fd, connection& conn)
+	{
+#ifdef REDUCT_IO_URING
+		if (m_ring)
+		{
+			// What the kernel still has for the connection completes first;
+			// the last completion closes it.
+			conn.closing = true;
+			if (conn.in_flight > 0)
+			{
+				if (!conn.shut)
+				{
+					::shutdown(fd, SHUT_RDWR);
+					conn.shut = true;
+				}
+				return;
+			}
+			if (conn.slot >= 0)
+			{
+				m_free_slots.push_back(conn.slot);
+			}
+			for (auto& response : conn.queued)
+			{
+				give_spare(std::move(response));
+			}
+			if (m_accept_stalled)
+			{
+				m_accept_stalled = false;
+				arm_accept();
+			}
+		}
+		else
+#endif
+		{
+			::epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+		}
+		::close(fd);
+		m_connections.erase(fd);
+	}
+
+	void serve(int fd, std::uint32_t events)
+	{
+		auto const it = m_connections.find(fd);
+		if (it == m_connections.end())
+		{
+			return;
+		}
+		auto& conn = it->second;
+		if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		{
+			char buffer[64 * 1024];
+			while (true)
+			{
+				auto const count = ::recv(fd, buffer, sizeof(buffer), 0);
+				if (count > 0)
+				{
+					conn.input.append(buffer, static_cast<std::size_t>(count));
+					continue;
+				}
+				if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				{
+					conn.closing = true;
+				}
+				if (count == 0 || errno != EINTR)
+				{
+					break;
+				}
+			}
+		}
+		// Also on errors, which a send reports, and for the interest once closing.
+		if ((events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) || conn.closing)
+		{
+			flush(fd, conn);
+		}
+		dispatch(fd, conn);
+	}
+
+	// Hands the next complete request of conn to the workers, unless one is
+	// already there; closes conn once it has nothing left to do.
+	void dispatch(int fd, connection& conn)
+	{
+		if (!conn.busy)
+		{
+			auto const available = conn.input.size() - conn.consumed;
+			if (available >= framing::header_size)
+			{
+				auto const size = framing::payload_size(conn.input.data() + conn.consumed);
+				if (size > framing::max_payload)
+				{
+					conn.input.clear();
+					conn.consumed = 0;
+					close_connection(fd, conn);
+					return;
+				}
+				if (available >= framing::header_size + size)
+				{
+					task request = take_spare();
+					request.fd = fd;
+					request.generation = conn.generation;
+					request.text.assign(conn.input, conn.consumed + framing::header_size, size);
+					conn.consumed += framing::header_size + size;
+					conn.busy = true;
+					{
+						std::lock_guard<std::mutex> lock(m_tasks_mutex);
+						m_tasks.push_back(std::move(request));
+					}
+					m_tasks_ready.notify_one();
+				}
+			}
+			if (conn.consumed == conn.input.size())
+			{
+				conn.input.clear();
+				conn.consumed = 0;
+			}
+			else if (conn.consumed > conn.input.size() / 2)
+			{
+				conn.input.erase(0, conn.consumed);
+				conn.consumed = 0;
+			}
+		}
+
+		bool idle = conn.closing && !conn.busy && conn.output.empty();
+#ifdef REDUCT_IO_URING
+		idle = idle && conn.sending.empty() && conn.queued.empty();
+#endif
+		if (idle)
+		{
+			close_connection(fd, conn);
+		}
+	}
+
+	void flush(int fd, connection& conn)
+	{
+		while (conn.written < conn.output.size())
+		{
+			auto const count = ::send(fd, conn.output.data() + conn.written, conn.output.size() - conn.written, MSG_NOSIGNAL);
+			if (count < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+				{
+					conn.closing = true;
+					conn.output.clear();
+					conn.written = 0;
+				}
+				break;
+			}
+			conn.written += static_cast<std::size_t>(count);
+		}
+
+		bool const pending = conn.written < conn.output.size();
+		if (!pending)
+		{
+			conn.output.clear();
+			conn.written = 0;
+		}
+		conn.writing = pending;
+		update_interest(fd, conn);
+	}
+
+	// Puts response on its way to conn; returns whether conn keeps it until it
+	// has been sent.
+	bool respond(int fd, connection& conn, task& response)
+	{
+#ifdef REDUCT_IO_URING
+		if (m_ring)
+		{
+			framing::write_header(response.header, response.text.size());
+			conn.queued.push_back(std::move(response));
+			if (conn.sending.empty())
+			{
+				send_queued(fd, conn);
+			}
+			return true;
+		}
+#endif
+		framing::append(conn.output, response.text);
+		flush(fd, conn);
+		return false;
+	}
+
+	// Moves the responses the workers have finished to their connections.
+	void finish_requests()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_done_mutex);
+			m_finishing.swap(m_done);
+		}
+		m_since_sweep += m_finishing.size();
+		for (auto& response : m_finishing)
+		{
+			bool kept = false;
+			auto const fd = response.fd;
+			auto const it = m_connections.find(fd);
+			if (it != m_connections.end() && it->second.generation == response.generation)
+			{
+				auto& conn = it->second;
+				conn.busy = false;
+				kept = respond(fd, conn, response);
+				dispatch(fd, conn);
+			}
+			if (!kept)
+			{
+				give_spare(std::move(response));
+			}
+		}
+		m_finishing.clear();
+
+		// Only once nothing waits for a worker, so no request waits on it.
+		if (m_since_sweep >= sweep_interval)
+		{
+			bool idle;
+			{
+				std::lock_guard<std::mutex> lock(m_tasks_mutex);
+				idle = m_tasks.empty();
+			}
+			if (idle)
+			{
+				interned().sweep();
+				m_since_sweep = 0;
+			}
+		}
+	}
+
+#ifdef REDUCT_IO_URING
+	enum operation : std::uint64_t
+	{
+		op_accept,
+		op_wake,
+		op_receive,
+		op_send,
+	};
+
+	// Set in the user data of a cancellation, which is otherwise that of the
+	// operation it cancels.
+	static constexpr std::uint64_t cancel_flag = std::uint64_t(1) << 63;
+
+	static constexpr unsigned fixed_buffers = 256;
+	static constexpr std::size_t receive_size = 16 * 1024;
+
+	static std::uint64_t operation_data(operation op, int fd)
+	{
+		return (static_cast<std::uint64_t>(op) << 32) | static_cast<std::uint32_t>(fd);
+	}
+
+	// A connection has at most one receive and one send in flight, so the
+	// user data of each operation is unique while it is.
+	io_uring_sqe* prepare(std::uint8_t opcode, operation op, int fd)
+	{
+		m_ring_pending.insert(operation_data(op, fd));
+		return m_ring->prepare(opcode, fd, operation_data(op, fd));
+	}
+
+	bool serve_ring()
+	{
+		m_receive_buffers.reset(new char[fixed_buffers * receive_size]);
+		std::vector<iovec> registered;
+		for (unsigned i = 0; i < fixed_buffers; ++i)
+		{
+			registered.push_back({ m_receive_buffers.get() + i * receive_size, receive_size });
+			m_free_slots.push_back(static_cast<int>(fixed_buffers - 1 - i));
+		}
+		m_fixed = m_ring->register_buffers(registered.data(), fixed_buffers);
+
+		arm_accept();
+		arm_wake();
+		while (!m_stopping.load(std::memory_order_acquire))
+		{
+			if (!m_ring->submit(1))
+			{
+				break;
+			}
+			m_ring->complete([&](std::uint64_t user_data, int result)
+			{
+				m_ring_pending.erase(user_data);
+				completed(static_cast<operation>(user_data >> 32), static_cast<int>(static_cast<std::uint32_t>(user_data)), result);
+			});
+		}
+
+		// The kernel may still write into the receive buffers and read the
+		// messages being sent: cancel each operation in flight and wait until
+		// all of them have completed. A cancellation the kernel cannot do
+		// (before 5.5 it has none) shuts the socket down instead, which ends
+		// any accept, receive or send on it just the same.
+		for (auto const user_data : m_ring_pending)
+		{
+			m_ring->prepare(IORING_OP_ASYNC_CANCEL, -1, user_data | cancel_flag)->addr = user_data;
+		}
+		while (!m_ring_pending.empty() && m_ring->submit(1))
+		{
+			m_ring->complete([&](std::uint64_t user_data, int result)
+			{
+				if (!(user_data & cancel_flag))
+				{
+					m_ring_pending.erase(user_data);
+				}
+				else if (result < 0 && result != -ENOENT && result != -EALREADY)
+				{
+					// Gone means it has completed, busy that it is about to.
+					end_operation(user_data & ~cancel_flag);
+				}
+			});
+		}
+		return true;
+	}
+
+	void end_operation(std::uint64_t user_data)
+	{
+		auto const fd = static_cast<int>(static_cast<std::uint32_t>(user_data));
+		if ((user_data >> 32) == op_wake)
+		{
+			wake();
+		}
+		else
+		{
+			::shutdown(fd, SHUT_RDWR);
+		}
+	}
+
+	void arm_accept()
+	{
+		prepare(IORING_OP_ACCEPT, op_accept, m_listen)->accept_flags = SOCK_CLOEXEC;
+	}
+
+	void arm_wake()
+	{
+		auto const sqe = prepare(IORING_OP_READ, op_wake, m_wake);
+		sqe->addr = reinterpret_cast<std::uint64_t>(&m_wake_value);
+		sqe->len = sizeof(m_wake_value);
+	}
+
+	void arm_receive(int fd, connection& conn)
+	{
+		bool const fixed = m_fixed && conn.slot >= 0;
+		auto const sqe = prepare(fixed ? IORING_OP_READ_FIXED : IORING_OP_RECV, op_receive, fd);
+		sqe->addr = reinterpret_cast<std::uint64_t>(receive_buffer(conn));
+		sqe->len = receive_size;
+		if (fixed)
+		{
+			sqe->off = static_cast<std::uint64_t>(-1);
+			sqe->buf_index = static_cast<std::uint16_t>(conn.slot);
+		}
+		++conn.in_flight;
+	}
+
+	char* receive_buffer(connection& conn)
+	{
+		return conn.slot >= 0 ? m_receive_buffers.get() + conn.slot * receive_size : conn.own.get();
+	}
+
+	// Sends the queued responses of conn with one sendmsg, the header and
+	// text of each a piece of its scatter list.
+	void send_queued(int fd, connection& conn)
+	{
+		conn.sending.swap(conn.queued);
+		conn.pieces.clear();
+		for (auto& response : conn.sending)
+		{
+			conn.pieces.push_back({ response.header, framing::header_size });
+			conn.pieces.push_back({ response.text.data(), response.text.size() });
+		}
+		conn.first_piece = 0;
+		send_pieces(fd, conn);
+	}
+
+	void send_pieces(int fd, connection& conn)
+	{
+		conn.message = msghdr{};
+		conn.message.msg_iov = conn.pieces.data() + conn.first_piece;
+		conn.message.msg_iovlen = std::min<std::size_t>(conn.pieces.size() - conn.first_piece, IOV_MAX);
+		auto const sqe = prepare(IORING_OP_SENDMSG, op_send, fd);
+		sqe->addr = reinterpret_cast<std::uint64_t>(&conn.message);
+		sqe->msg_flags = MSG_NOSIGNAL;
+		++conn.in_flight;
+	}
+
+	void completed(operation op, int fd, int result)
+	{
+		if (m_stopping.load(std::memory_order_acquire))
+		{
+			return;
+		}
+		if (op == op_accept)
+		{
+			if (result >= 0)
+			{
+				auto& conn = open_connection(result);
+				if (m_free_slots.empty())
+				{
+					conn.own.reset(new char[receive_size]);
+				}
+				else
+				{
+					conn.slot = m_free_slots.back();
+					m_free_slots.pop_back();
+				}
+				arm_receive(result, conn);
+			}
+
+			// Errors that concern only the connection being accepted leave the
+			// listener as it was. Any other, such as running out of descriptors,
+			// would come straight back: accepting resumes when a connection closes.
+			if (result >= 0 || result == -EINTR || result == -EAGAIN || result == -ECONNABORTED || result == -EPROTO
+				|| result == -ENETDOWN || result == -ENETUNREACH || result == -EHOSTDOWN || result == -EHOSTUNREACH)
+			{
+				arm_accept();
+			}
+			else
+			{
+				m_accept_stalled = true;
+			}
+			return;
+		}
+		if (op == op_wake)
+		{
+			finish_requests();
+			arm_wake();
+			return;
+		}
+
+		auto const it = m_connections.find(fd);
+		if (it == m_connections.end())
+		{
+			return;
+		}
+		auto& conn = it->second;
+		--conn.in_flight;
+		if (op == op_receive)
+		{
+			if (result > 0)
+			{
+				conn.input.append(receive_buffer(conn), static_cast<std::size_t>(result));
+				if (!conn.closing)
+				{
+					arm_receive(fd, conn);
+				}
+			}
+			else if (result != -EINTR && result != -EAGAIN)
+			{
+				conn.closing = true;
+			}
+			else if (!conn.closing)
+			{
+				arm_receive(fd, conn);
+			}
+		}
+		else if (op == op_send)
+		{
+			if (result <= 0)
+			{
+				conn.closing = true;
+				conn.first_piece = conn.pieces.size();
+				for (auto& response : conn.queued)
+				{
+					give_spare(std::move(response));
+				}
+				conn.queued.clear();
+			}
+			auto sent = static_cast<std::size_t>(std::max(result, 0));
+			while (conn.first_piece < conn.pieces.size() && sent >= conn.pieces[conn.first_piece].iov_len)
+			{
+				sent -= conn.pieces[conn.first_piece++].iov_len;
+			}
+			if (conn.first_piece < conn.pieces.size())
+			{
+				auto& piece = conn.pieces[conn.first_piece];
+				piece.iov_base = static_cast<char*>(piece.iov_base) + sent;
+				piece.iov_len -= sent;
+				send_pieces(fd, conn);
+			}
+			else
+			{
+				for (auto& response : conn.sending)
+				{
+					give_spare(std::move(response));
+				}
+				conn.sending.clear();
+				if (!conn.queued.empty())
+				{
+					send_queued(fd, conn);
+				}
+			}
+		}
+		dispatch(fd, conn);
+	}
+
+	std::unique_ptr<io_ring> m_ring;
+	std::unique_ptr<char[]> m_receive_buffers;
+	std::vector<int> m_free_slots;
+	std::uint64_t m_wake_value = 0;
+	std::unordered_set<std::uint64_t> m_ring_pending;
+	bool m_fixed = false;
+	bool m_accept_stalled = false; // no accept armed after an error
+#endif
+
+	task take_spare()
+	{
+		std::lock_guard<std::mutex> lock(m_spare_mutex);
+		if (m_spare.empty())
+		{
+			return task();
+		}
+		task spare = std::move(m_spare.back());
+		m_spare.pop_back();
+		return spare;
+	}
+
+	void give_spare(task spare)
+	{
+		spare.text.clear();
+		std::lock_guard<std::mutex> lock(m_spare_mutex);
+		m_spare.push_back(std::move(spare));
+	}
+
+	void work()
+	{
+		while (true)
+		{
+			task request;
+			{
+				std::unique_lock<std::mutex> lock(m_tasks_mutex);
+				m_tasks_ready.wait(lock, [this]() { return m_tasks_closed || !m_tasks.empty(); });
+				if (m_tasks.empty())
+				{
+					return;
+				}
+				request = std::move(m_tasks.front());
+				m_tasks.pop_front();
+			}
+
+			// Requests are evaluated, never run as REPL commands: a client
+			// cannot make the server write files.
+			REDUCT_TRACE("request");
+			table const value = evaluate_form(parsed().parse(request.text), m_env);
+			request.text.clear();
+			print_to(request.text, value);
+
+			bool first;
+			{
+				std::lock_guard<std::mutex> lock(m_done_mutex);
+				first = m_done.empty();
+				m_done.push_back(std::move(request));
+			}
+			if (first)
+			{
+				wake();
+			}
+		}
+	}
+
+	table const m_env;
+	unsigned const m_threads;
+	io_backend const m_io;
+	int m_listen = -1;
+	int m_epoll = -1;
+	int m_wake = -1;
+	std::atomic<bool> m_stopping{ false };
+	std::uint64_t m_generation = 0;
+	std::unordered_map<int, connection> m_connections;
+	std::size_t m_since_sweep = 0;
+
+	std::mutex m_tasks_mutex;
+	std::condition_variable m_tasks_ready;
+	std::deque<task> m_tasks;
+	bool m_tasks_closed = false;
+
+	std::mutex m_done_mutex;
+	std::vector<task> m_done;
+	std::vector<task> m_finishing;
+
+	std::mutex m_spare_mutex;
+	std::vector<task> m_spare;
+};
+
+
+// Load generator for a server: each connection sends the same request and
+// waits for its response, requests times over. Prints requests per second and
+// the median and 99th percentile latency; returns the exit status.
+int run_load(std::string const& path, unsigned connections, std::size_t requests, std::string const& text)
+{
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+	{
+		std::cerr << "Socket path too long: " << path << "\n";
+		return 1;
+	}
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	connections = std::max(connections, 1u);
+	std::vector<std::vector<std::uint64_t>> latencies(connections);
+	std::atomic<bool> failed{ false };
+	std::vector<std::thread> clients;
+	auto const start = std::chrono::steady_clock::now();
+	for (unsigned c = 0; c < connections; ++c)
+	{
+		clients.emplace_back([&, c]()
+		{
+			int const fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr const*>(&address), sizeof(address)) != 0)
+			{
+				failed = true;
+				if (fd >= 0)
+				{
+					::close(fd);
+				}
+				return;
+			}
+
+			std::string frame;
+			framing::append(frame, text);
+			std::string response;
+			auto const receive = [&](char* data, std::size_t size)
+			{
+				while (size > 0)
+				{
+					auto const count = ::recv(fd, data, size, 0);
+					if (count <= 0)
+					{
+						return false;
+					}
+					data += count;
+					size -= static_cast<std::size_t>(count);
+				}
+				return true;
+			};
+
+			auto& mine = latencies[c];
+			mine.reserve(requests);
+			for (std::size_t i = 0; i < requests; ++i)
+			{
+				auto const sent = std::chrono::steady_clock::now();
+				char header[framing::header_size];
+				if (::send(fd, frame.data(), frame.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(frame.size())
+					|| !receive(header, sizeof(header)))
+				{
+					failed = true;
+					break;
+				}
+				response.resize(framing::payload_size(header));
+				if (!receive(response.data(), response.size()))
+				{
+					failed = true;
+					break;
+				}
+				mine.push_back(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - sent).count()));
+			}
+			::close(fd);
+		});
+	}
+	for (auto& client : clients)
+	{
+		client.join();
+	}
+	auto const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::vector<std::uint64_t> all;
+	for (auto const& mine : latencies)
+	{
+		all.insert(all.end(), mine.begin(), mine.end());
+	}
+	if (all.empty())
+	{
+		std::cerr << "No responses from " << path << "\n";
+		return 1;
+	}
+	std::sort(all.begin(), all.end());
+	auto const percentile = [&](double p) { return all[std::min(all.size() - 1, static_cast<std::size_t>(p * static_cast<double>(all.size())))] / 1000.0; };
+	std::cout << "requests: " << all.size() << "\n"
+		<< "connections: " << connections << "\n"
+		<< "requests/sec: " << static_cast<std::uint64_t>(static_cast<double>(all.size()) / seconds) << "\n"
+		<< "p50: " << percentile(0.50) << " us\n"
+		<< "p99: " << percentile(0.99) << " us\n";
+	return failed ? 1 : 0;
+}
+#endif
+
+
+// Round trips through the storage formats, for --self-test: images, the table
+// store, the update log and B+-tree files, in a scratch directory made under
+// directory and removed afterwards. Unlike asserts these run in release builds;
+// each failed check is reported. Returns whether all passed.
+auto self_test(std::filesystem::path const& directory) -> bool
+{
+	bool passed = true;
+	auto const check = [&](bool ok, char const* what)
+	{
+		if (!ok)
+		{
+			std::cerr << "Self-test failed: " << what << "\n";
+			passed = false;
+		}
+	};
+#define REDUCT_CHECK(condition) check((condition), #condition)
+
+	auto const scratch = directory
+		/ ("reduct-check-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+	std::error_code error;
+	std::filesystem::create_directories(scratch, error);
+	if (error)
+	{
+		std::cerr << "Cannot create " << scratch.string() << "\n";
+		return false;
+	}
+	table const sample({
+		{"a", "1"},
+		{"b", table({ {"c", "a string long enough to go in a block"}, {"d", ""} })},
+		{"e", table()}
+	});
+
+	auto const image = (scratch / "sample.img").string();
+	REDUCT_CHECK(save_binary(sample, image));
+	REDUCT_CHECK(load_binary(image) == sample);
+	REDUCT_CHECK(load_binary(image)["b"]["c"] == sample["b"]["c"]);
+
+	binary_options compressed;
+	compressed.compress_strings = true;
+	compressed.dictionary_sample = sample;
+	REDUCT_CHECK(save_binary(sample, image, compressed));
+	REDUCT_CHECK(load_binary(image) == sample);
+	REDUCT_CHECK(load_binary(image)["b"]["c"] == sample["b"]["c"]);
+
+	// A map large enough to be stored in parts, and a version changing one.
+	{
+		table_store store((scratch / "store").string());
+		table_builder entries;
+		for (int i = 0; i < 100; ++i)
+		{
+			entries.add(std::to_string(i), sample);
+		}
+		auto const first = entries.build();
+		auto const second = first.with("50", "changed");
+		REDUCT_CHECK(store.commit(first) == 0 && store.commit(second) == 1);
+		REDUCT_CHECK(store.load(0) == first && store.load(1) == second);
+		REDUCT_CHECK(store.load(1)["50"] == "changed" && store.load(1)["51"] == sample);
+	}
+
+	// Three updates go into a checkpoint, the fourth is replayed.
+	auto const log_directory = (scratch / "log").string();
+	{
+		table_log log(log_directory, 3);
+		REDUCT_CHECK(log.is_open());
+		REDUCT_CHECK(log.update({ "a" }, "1"));
+		REDUCT_CHECK(log.update({ "b", "c" }, sample["b"]["c"]));
+		REDUCT_CHECK(log.update({ "b", "d" }, ""));
+		REDUCT_CHECK(log.update({ "e" }, table()));
+	}
+	{
+		table_log log(log_directory, 3);
+		REDUCT_CHECK(log.recovered() == 1);
+		REDUCT_CHECK(log.state() == sample);
+	}
+
+	auto const tree = (scratch / "sample.db").string();
+	{
+		auto const created = create_disk_table(tree, sample, disk_cache_bytes);
+		auto const changed = created.with("f", "2");
+		REDUCT_CHECK(commit_disk_table(changed));
+		REDUCT_CHECK(created == sample);
+		REDUCT_CHECK(changed == sample.with("f", "2"));
+	}
+	REDUCT_CHECK(open_disk_table(tree, disk_cache_bytes) == sample.with("f", "2"));
+
+#undef REDUCT_CHECK
+	std::filesystem::remove_all(scratch, error);
+	return passed;
+}
+
+
+int main(int argc, char* argv[])
+{
+	table const empty;
+	assert(empty == empty);
+	assert(empty == table());
+	assert(empty != "test");
+	
+	table const test = "test";
+	assert(test == table("test"));
+	assert(test != table());
+
+#ifndef NDEBUG
+	// Round trips through representations in memory. Those through files are in
+	// self_test(), run by --self-test.
+	{
+		table const sample({
+			{"a", "1"},
+			{"b", table({ {"c", "a string long enough to go in a block"}, {"d", ""} })},
+			{"e", table()}
+		});
+
+		// Maps keyed 0..n-1 go out as arrays and come back as the same maps.
+		std::ostringstream json;
+		auto const escapes = sample.with("g", table({ {"0", "\"quoted\"\n\ttab"}, {"1", "caf\xc3\xa9 \x01"} }));
+		write_json(escapes, json);
+		assert(read_json(json.str()) == escapes);
+
+		// Chunks as small as a few bytes, so that rows and quoted line breaks
+		// straddle the boundaries between threads. Quotes inside unquoted fields
+		// and after quoted parts are text, and do not open quotes.
+		std::string const csv_text = "name,note\nann,\"two\nlines\"\nbob,\"\"\"quoted\"\", comma\"\r\ncy,\n\"d\ne\",x\n"
+			"a\"b,\"c\"d\"\nf,\"g\nh\"\n";
+		csv_options one_thread;
+		one_thread.threads = 1;
+		csv_options many_threads;
+		many_threads.threads = 7;
+		many_threads.chunk_min = 1;
+		auto const rows = read_csv(csv_text, one_thread);
+		assert(rows["3"]["name"] == "d\ne" && rows["6"] == lookup_error);
+		assert(rows["4"]["name"] == "a\"b" && rows["4"]["note"] == "cd\"");
+		assert(rows["5"]["note"] == "g\nh");
+		assert(rows["0"]["note"] == "two\nlines");
+		assert(rows["1"]["note"] == "\"quoted\", comma");
+		assert(read_csv(csv_text, many_threads) == rows);
+
+		// Ropes equal and hash like the flat strings they hold.
+		std::string const left(1500, 'l');
+		std::string const right = "r" + std::string(1499, 's');
+		auto const joined = concat(left, right);
+		table const flat = left + right;
+		table const middle = (left + right).substr(1000, 1200);
+		assert(joined.source() && !flat.source());
+		assert(joined == flat && flat == joined);
+		assert(joined.hash() == flat.hash());
+		assert(substring(joined, 1000, 1200) == middle);
+		assert(substring(joined, 1000, 1200).hash() == middle.hash());
+
+		// Every kernel set this processor runs agrees with the scalar one, on
+		// lengths around whole words of rows, with absent numbers and a sparse
+		// selection. The numbers are whole so that sums do not depend on order.
+		auto const& kernel_sets = column_kernels::available();
+		for (std::size_t count : { 1, 7, 63, 64, 65, 130, 333 })
+		{
+			std::vector<double> numbers(count);
+			std::vector<std::uint32_t> codes(count);
+			std::vector<std::uint64_t> selected((count + 63) / 64, 0);
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				bool const absent = (i % 7 == 3);
+				numbers[i] = absent ? std::numeric_limits<double>::quiet_NaN() : static_cast<double>((i * 37) % 101) - 50;
+				codes[i] = static_cast<std::uint32_t>((i * 13) % 5);
+				selected[i / 64] |= std::uint64_t(!absent && i % 5 == 2) << (i % 64);
+			}
+			std::vector<std::uint64_t> in_range(selected.size()), equal(selected.size());
+			kernel_sets.front().range(numbers.data(), count, -10, 20, in_range.data());
+			kernel_sets.front().equal(codes.data(), count, 3, equal.data());
+			auto const totals = kernel_sets.front().aggregate(numbers.data(), selected.data(), count);
+			for (auto const& set : kernel_sets)
+			{
+				std::vector<std::uint64_t> bits(selected.size(), ~std::uint64_t(0));
+				set.range(numbers.data(), count, -10, 20, bits.data());
+				assert(bits == in_range);
+				set.equal(codes.data(), count, 3, bits.data());
+				assert(bits == equal);
+				auto const result = set.aggregate(numbers.data(), selected.data(), count);
+				assert(result.sum == totals.sum && result.min == totals.min && result.max == totals.max);
+			}
+		}
+
+		// A node that another thread drops last is queued for the thread that
+		// made it and freed when that one reconciles; once it has exited, by the
+		// thread that drops it.
+		struct counted_source : table_source
+		{
+			explicit counted_source(std::atomic<int>& freed)
+				: freed(freed)
+			{
+			}
+
+			~counted_source() override
+			{
+				++freed;
+			}
+
+			bool is_string() const override
+			{
+				return true;
+			}
+
+			std::size_t size() const override
+			{
+				return 0;
+			}
+
+			table lookup(table const& /*key*/) const override
+			{
+				return lookup_error;
+			}
+
+			table::values_type decode() const override
+			{
+				return std::string();
+			}
+
+			std::atomic<int>& freed;
+		};
+
+		std::atomic<int> freed = 0;
+		{
+			table made_here(std::make_unique<counted_source>(freed));
+			std::thread([dropped = std::move(made_here)]() mutable { dropped = table(); }).join();
+		}
+		assert(freed == 0);
+		table::reconcile();
+		assert(freed == 1);
+
+		table made_there;
+		std::thread([&]() { made_there = table(std::make_unique<counted_source>(freed)); }).join();
+		assert(freed == 1);
+		made_there = table();
+		assert(freed == 2);
+
+		// Equal tables interned share one node, as do their interned strings, and
+		// a sweep drops what nobody else refers to, including the children of
+		// what it drops, and nothing still held.
+		intern_pool pool;
+		{
+			auto const first = pool.intern(table({ {"k", "v"} }));
+			auto const second = pool.intern(table({ {"k", "v"} }));
+			auto const nodes = footprint(table({ {"a", first}, {"b", second} }))["nodes"];
+			assert(nodes["total"] == "6" && nodes["interned"] == "3");
+			assert(pool.sweep() == 0);
+			auto const again = pool.intern(table({ {"k", "v"} }));
+			assert(footprint(table({ {"a", first}, {"b", again} }))["nodes"]["total"] == "6");
+		}
+		assert(pool.sweep() == 3);
+		assert(pool.sweep() == 0);
+	}
+#endif
+
+	// --image resumes a saved session, --disk keeps the environment in a B+-tree
+	// file, --load adds a JSON prelude to the environment and --csv the rows of
+	// a CSV file, --save-image writes the environment once loading is done,
+	// --threads sets the number of evaluation workers in batch and server mode.
+	// --serve listens on a Unix socket; --bench drives a server on one with
+	// --connections clients sending --request, --requests times each. --io basic
+	// turns off io_uring for both. --trace records spans from then on and writes
+	// them to a file on the way out. --self-test runs the round trips through
+	// files in a scratch directory under the one given, then exits.
+	table env;
+	unsigned threads = std::thread::hardware_concurrency();
+	std::string serve_path;
+	std::string bench_path;
+	unsigned connections = 8;
+	std::size_t requests = 10000;
+	std::string request = "x";
+	io_backend io = io_backend::uring;
+#ifdef REDUCT_TRACING
+	struct trace_file
+	{
+		std::string path;
+		~trace_file()
+		{
+			if (!path.empty() && !tracing::save(path))
+			{
+				std::cerr << "Cannot write " << path << "\n";
+			}
+		}
+	} trace;
+#endif
+	for (int i = 1; i < argc; i += 2)
+	{
+		std::string const option = argv[i];
+		if (i + 1 == argc)
+		{
+			std::cerr << "Missing argument to " << option << "\n";
+			return 2;
+		}
+
+		if (option == "--image")
+		{
+			env = load_session(argv[i + 1]);
+		}
+		else if (option == "--disk")
+		{
+			env = open_disk_session(env, argv[i + 1]);
+		}
+		else if (option == "--load")
+		{
+			env = load_prelude(env, argv[i + 1]);
+		}
+		else if (option == "--csv")
+		{
+			env = load_rows(env, argv[i + 1]);
+		}
+		else if (option == "--threads")
+		{
+			threads = static_cast<unsigned>(std::strtoul(argv[i + 1], nullptr, 10));
+		}
+		else if (option == "--serve")
+		{
+			serve_path = argv[i + 1];
+		}
+		else if (option == "--bench")
+		{
+			bench_path = argv[i + 1];
+		}
+		else if (option == "--connections")
+		{
+			connections = static_cast<unsigned>(std::strtoul(argv[i + 1], nullptr, 10));
+		}
+		else if (option == "--requests")
+		{
+			requests = std::strtoull(argv[i + 1], nullptr, 10);
+		}
+#ifdef REDUCT_TRACING
+		else if (option == "--trace")
+		{
+			trace.path = argv[i + 1];
+			tracing::enabled = true;
+		}
+#endif
+		else if (option == "--io")
+		{
+			io = (std::string(argv[i + 1]) == "basic") ? io_backend::basic : io_backend::uring;
+		}
+		else if (option == "--request")
+		{
+			request = argv[i + 1];
+		}
+		else if (option == "--self-test")
+		{
+			return self_test(argv[i + 1]) ? 0 : 1;
+		}
+		else if (option == "--save-image")
+		{
+			if (!save_session(env, argv[i + 1]))
+			{
+				std::cerr << "Cannot write " << argv[i + 1] << "\n";
+				return 1;
+			}
+		}
+		else
+		{
+			std::cerr << "Unknown option " << option << "\n";
+			return 2;
+		}
+
+		if (env["type"] == "error")
+		{
+			std::cerr << env << "\n";
+			return 1;
+		}
+	}
+
+#ifdef __linux__
+	if (!bench_path.empty())
+	{
+		return run_load(bench_path, connections, requests, request);
+	}
+	if (!serve_path.empty())
+	{
+		static socket_server* serving = nullptr;
+		socket_server server(env, threads, io);
+		serving = &server;
+		auto const stop = [](int) { serving->stop(); };
+		std::signal(SIGINT, stop);
+		std::signal(SIGTERM, stop);
+		return server.run(serve_path);
+	}
+#else
+	if (!serve_path.empty() || !bench_path.empty())
+	{
+		std::cerr << "Server mode needs Linux\n";
+		return 2;
+	}
+#endif
+
+	if (!stdin_is_terminal())
+	{
+		return run_batch(stdin, env, threads, io);
+	}
+
+	std::cout << "empty: '" << empty << "'\n";
+	std::cout << "symbol: '" << test << "'\n";
+
+	// Forms can span lines: open parens and strings carry on to the next line,
+	// and each form is evaluated as soon as it is complete. Commands are only
+	// taken between forms.
+	reader in(true);
+	std::vector<table> forms;
+	std::string input;
+	while (true)
+	{
+		std::cout << (in.pending() ? "  " : "> ");
+		if (!std::getline(std::cin, input))
+		{
+			if (in.pending())
+			{
+				std::cout << "\n" << in.finish();
+			}
+			std::cout << "\n";
+			return 0;
+		}
+		if (!in.pending() && input.compare(0, 1, ":") == 0)
+		{
+			std::cout << run_line(input, env) << "\n";
+			continue;
+		}
+
+		input += '\n';
+		in.feed(input, forms);
+		for (auto const& form : forms)
+		{
+			std::cout << evaluate_form(form, env) << "\n";
+		}
+		forms.clear();
 	}
 }
\ No newline at end of file